@@ -62,16 +62,43 @@ static void run_file(const char *path) {
   if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+static void usage() {
+  fprintf(stderr, "Usage: valp [options] [path]\n");
+  fprintf(stderr, "  --gc-<option>=<value>  collector setting, e.g. --gc-heap-limit=64M,\n");
+  fprintf(stderr, "                         also read from VALP_GC_<OPTION>\n");
+  exit(64);
+}
+
 int main(int argc, const char* argv[]) {
   init_vm();
 
-  if (argc == 1) {
+  // Environment first, so options on the command line win.
+  valp_gc_config config = vm.gc;
+  gc_config_from_env(&config);
+
+  int arg = 1;
+  for (; arg < argc && strncmp(argv[arg], "--gc-", 5) == 0; arg++) {
+    char name[64];
+    const char *equals = strchr(argv[arg], '=');
+    size_t length = equals == NULL ? 0 : (size_t)(equals - argv[arg] - 5);
+    if (length == 0 || length >= sizeof(name)) usage();
+
+    memcpy(name, argv[arg] + 5, length);
+    name[length] = '\0';
+    if (!gc_config_option(&config, name, equals + 1)) {
+      fprintf(stderr, "Invalid option \"%s\".\n", argv[arg]);
+      usage();
+    }
+  }
+
+  configure_gc(&config);
+
+  if (arg == argc) {
     repl();
-  } else if (argc == 2) {
-    run_file(argv[1]);
+  } else if (arg + 1 == argc) {
+    run_file(argv[arg]);
   } else {
-    fprintf(stderr, "Usage: valp [path]\n");
-    exit(64);
+    usage();
   }
 
   free_vm();
@@ -1,6 +1,7 @@
 #include <stdio.h>
 
 #include "array.h"
+#include "../valp_memory.h"
 #include "../valp_native.h"
 #include "../valp_vm.h"
 
@@ -24,6 +25,7 @@ static valp_value array_push(int arg_count, valp_value *args) {
   valp_value element = args[1];
 
   write_valp_value_array(&arr->values, element);
+  WRITE_BARRIER(arr, element);
 
   return NIL_VAL;
 }
@@ -54,6 +56,7 @@ static valp_value array_insert(int arg_count, valp_value *args) {
   valp_value element = args[1];
 
   prepend_valp_value_array(&arr->values, element);
+  WRITE_BARRIER(arr, element);
 
   return NIL_VAL;
 }
@@ -70,8 +73,10 @@ static valp_value array_drop(int arg_count, valp_value *args) {
 
   valp_value first_element = arr->values.values[0];
 
+  // Shifting down moves elements past an incremental scan of the array.
   for (int i = 0; i < arr->values.count - 1; i++) {
     arr->values.values[i] = arr->values.values[i + 1];
+    WRITE_BARRIER(arr, arr->values.values[i]);
   }
 
   arr->values.count--;
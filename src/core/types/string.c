@@ -2,6 +2,7 @@
 #include <string.h>
 
 #include "string.h"
+#include "../valp_memory.h"
 #include "../valp_native.h"
 #include "../valp_vm.h"
 
@@ -32,6 +33,7 @@ static valp_value string_reverse(int arg_count, valp_value *args) {
       str->chars[i] = str->chars[j];
       str->chars[j] = temp;
   }
+  string_changed(str);
   
   return OBJ_VAL(str);
 }
@@ -62,6 +64,7 @@ static valp_value string_replace(int arg_count, valp_value *args) {
       str->chars[i] = arg2->chars[0];
     }
   }
+  string_changed(str);
 
   return OBJ_VAL(str);
 }
@@ -87,6 +90,8 @@ static valp_value string_split(int arg_count, valp_value *args) {
   }
 
   valp_array *arr = new_array();
+  push(OBJ_VAL(arr));
+
   valp_string *str = AS_STRING(args[0]);
   valp_string *arg = AS_STRING(args[1]);
   int prev_begin = 0;
@@ -97,14 +102,18 @@ static valp_value string_split(int arg_count, valp_value *args) {
       char slice[i - prev_begin + 1];
       get_slice(str->chars, prev_begin, i - 1, slice);
       
-      valp_string *new_str = copy_string(slice, i);
+      valp_string *new_str = new_string(slice, i - prev_begin);
+      push(OBJ_VAL(new_str));
       write_valp_value_array(&arr->values, OBJ_VAL(new_str));
+      WRITE_BARRIER(arr, OBJ_VAL(new_str));
+      pop();
 
       prev_begin = i + 1;
       ++i;
     }
   }
 
+  pop();
   return OBJ_VAL(arr);
 }
 
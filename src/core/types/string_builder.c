@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "string_builder.h"
+#include "../valp_memory.h"
+#include "../valp_native.h"
+#include "../valp_vm.h"
+
+// Makes room for extra more characters, doubling the buffer so appends
+// stay amortized constant.
+static void reserve(valp_string_builder *builder, int extra) {
+  int needed = builder->length + extra;
+  if (needed <= builder->capacity) return;
+
+  int capacity = GROW_CAPACITY(builder->capacity);
+  while (capacity < needed) capacity *= 2;
+
+  builder->chars = GROW_ARRAY(char, builder->chars, builder->capacity, capacity);
+  builder->capacity = capacity;
+}
+
+static void append_chars(valp_string_builder *builder, const char *chars, int length) {
+  reserve(builder, length);
+  memcpy(builder->chars + builder->length, chars, length);
+  builder->length += length;
+}
+
+// Appends a string, a rope or a number the way print shows it. The value
+// is one of the arguments, so flattening a rope cannot lose it.
+static bool append_value(valp_string_builder *builder, valp_value value, const char *method) {
+  if (IS_ROPE(value)) value = OBJ_VAL(flatten_rope(AS_ROPE(value)));
+
+  if (IS_STRING(value)) {
+    append_chars(builder, AS_STRING(value)->chars, AS_STRING(value)->length);
+    return true;
+  }
+
+  if (IS_NUMBER(value)) {
+    char number[32];
+    int length = snprintf(number, sizeof(number), "%g", AS_NUMBER(value));
+    append_chars(builder, number, length);
+    return true;
+  }
+
+  runtime_error("%s() takes a string or a number.", method);
+  return false;
+}
+
+static valp_value string_builder_append(int arg_count, valp_value *args) {
+  if (arg_count != 1) {
+    runtime_error("append() takes 1 argument, given %d", arg_count);
+    return UNDEFINED_VAL;
+  }
+
+  if (!append_value(AS_STRING_BUILDER(args[0]), args[1], "append")) return UNDEFINED_VAL;
+
+  return args[0];
+}
+
+static valp_value string_builder_append_line(int arg_count, valp_value *args) {
+  if (arg_count > 1) {
+    runtime_error("append_line() takes 0 or 1 arguments, given %d", arg_count);
+    return UNDEFINED_VAL;
+  }
+
+  valp_string_builder *builder = AS_STRING_BUILDER(args[0]);
+
+  if (arg_count == 1 && !append_value(builder, args[1], "append_line")) return UNDEFINED_VAL;
+  append_chars(builder, "\n", 1);
+
+  return args[0];
+}
+
+static valp_value string_builder_length(int arg_count, valp_value *args) {
+  if (arg_count != 0) {
+    runtime_error("len() takes 0 arguments, given %d", arg_count);
+    return UNDEFINED_VAL;
+  }
+
+  return NUMBER_VAL(AS_STRING_BUILDER(args[0])->length);
+}
+
+// Keeps the buffer for whatever gets built next.
+static valp_value string_builder_clear(int arg_count, valp_value *args) {
+  if (arg_count != 0) {
+    runtime_error("clear() takes 0 arguments, given %d", arg_count);
+    return UNDEFINED_VAL;
+  }
+
+  AS_STRING_BUILDER(args[0])->length = 0;
+
+  return args[0];
+}
+
+static valp_value string_builder_build(int arg_count, valp_value *args) {
+  if (arg_count != 0) {
+    runtime_error("build() takes 0 arguments, given %d", arg_count);
+    return UNDEFINED_VAL;
+  }
+
+  valp_string_builder *builder = AS_STRING_BUILDER(args[0]);
+  if (builder->length == 0) return OBJ_VAL(new_string("", 0));
+
+  return OBJ_VAL(new_string(builder->chars, builder->length));
+}
+
+void define_string_builder_methods() {
+  define_native(&vm.string_builder_methods, "append", string_builder_append);
+  define_native(&vm.string_builder_methods, "append_line", string_builder_append_line);
+  define_native(&vm.string_builder_methods, "len", string_builder_length);
+  define_native(&vm.string_builder_methods, "clear", string_builder_clear);
+  define_native(&vm.string_builder_methods, "build", string_builder_build);
+}
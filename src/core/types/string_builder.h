@@ -0,0 +1,6 @@
+#ifndef valp_string_builder_h
+#define valp_string_builder_h
+
+void define_string_builder_methods();
+
+#endif
@@ -10,12 +10,16 @@ void init_bytecode(valp_bytecode *bytecode) {
   bytecode->code = NULL;
   bytecode->lines = NULL;
   init_valp_value_array(&bytecode->constants);
+  bytecode->cache_count = 0;
+  bytecode->cache_capacity = 0;
+  bytecode->caches = NULL;
 }
 
 void free_bytecode(valp_bytecode *bytecode) {
   FREE_ARRAY(uint8_t, bytecode->code, bytecode->capacity);
   FREE_ARRAY(int, bytecode->lines, bytecode->capacity);
   free_valp_value_array(&bytecode->constants);
+  FREE_ARRAY(valp_inline_cache, bytecode->caches, bytecode->cache_capacity);
   init_bytecode(bytecode);
 }
 
@@ -38,3 +42,14 @@ int add_constant(valp_bytecode *bytecode, valp_value value) {
   pop();
   return bytecode->constants.count - 1;
 }
+
+int add_inline_cache(valp_bytecode *bytecode) {
+  if (bytecode->cache_capacity < bytecode->cache_count + 1) {
+    int old_capacity = bytecode->cache_capacity;
+    bytecode->cache_capacity = GROW_CAPACITY(old_capacity);
+    bytecode->caches = GROW_ARRAY(valp_inline_cache, bytecode->caches, old_capacity, bytecode->cache_capacity);
+  }
+
+  bytecode->caches[bytecode->cache_count].count = 0;
+  return bytecode->cache_count++;
+}
@@ -12,9 +12,9 @@ typedef enum {
   OP_POP,
   OP_GET_LOCAL,
   OP_SET_LOCAL,
-  OP_GET_GLOBAL,
-  OP_DEFINE_GLOBAL,
-  OP_SET_GLOBAL,
+  OP_GET_GLOBAL_SLOT,
+  OP_DEFINE_GLOBAL_SLOT,
+  OP_SET_GLOBAL_SLOT,
   OP_GET_UPVALUE,
   OP_SET_UPVALUE,
   OP_GET_PROPERTY,
@@ -24,6 +24,9 @@ typedef enum {
   OP_EQUAL,
   OP_GREATER,
   OP_LESS,
+  OP_NOT_EQUAL,
+  OP_GREATER_EQUAL,
+  OP_LESS_EQUAL,
   OP_ADD,
   OP_SUBTRACT,
   OP_MULTIPLY,
@@ -36,6 +39,7 @@ typedef enum {
   OP_JUMP_COMPARE,
   OP_LOOP,
   OP_CALL,
+  OP_TAIL_CALL,
   OP_INVOKE,
   OP_SUPER_INVOKE,
   OP_CLOSURE,
@@ -48,19 +52,55 @@ typedef enum {
   OP_NEW_ARRAY,
   OP_SLICE,
   OP_BREAK,
+
+  // Type specialized forms. The compiler never emits these, run() rewrites
+  // the generic instruction in place once it has seen the operand types.
+  OP_ADD_NUM,
+  OP_ADD_STR,
+  OP_SUBTRACT_NUM,
+  OP_MULTIPLY_NUM,
+  OP_DIVIDE_NUM,
+  OP_GREATER_NUM,
+  OP_LESS_NUM,
+  OP_GREATER_EQUAL_NUM,
+  OP_LESS_EQUAL_NUM,
 } valp_op_code;
 
+#define INLINE_CACHE_SIZE 4
+#define INLINE_CACHE_MEGAMORPHIC -1
+
+// What a property access or invoke resolved to for receivers of one shape.
+// slot is the field slot, or -1 when the name is a method of the class.
+// For stores that add a field, next_shape is the shape after the store.
+typedef struct {
+  valp_shape *shape;
+  valp_shape *next_shape;
+  int slot;
+  valp_obj_closure *method;
+} valp_cache_entry;
+
+// Per call site cache. count is the number of valid entries, or
+// INLINE_CACHE_MEGAMORPHIC once the site saw too many shapes to cache.
+typedef struct {
+  int count;
+  valp_cache_entry entries[INLINE_CACHE_SIZE];
+} valp_inline_cache;
+
 typedef struct {
   int count;
   int capacity;
   uint8_t *code;
   int *lines;
   valp_value_array constants;
+  int cache_count;
+  int cache_capacity;
+  valp_inline_cache *caches;
 } valp_bytecode;
 
 void init_bytecode(valp_bytecode *bytecode);
 void free_bytecode(valp_bytecode *bytecode);
 void write_bytecode(valp_bytecode *bytecode, uint8_t byte, int line);
 int add_constant(valp_bytecode *bytecode, valp_value value);
+int add_inline_cache(valp_bytecode *bytecode);
 
 #endif
@@ -6,6 +6,7 @@
 #include "valp_compiler.h"
 #include "valp_memory.h"
 #include "valp_scanner.h"
+#include "valp_vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "valp_debug.h"
@@ -81,6 +82,16 @@ typedef struct valp_compiler {
   int local_count;
   valp_upvalue upvalues[UINT8_COUNT];
   int scope_depth;
+
+  // Offsets used by constant folding: the last constant load and
+  // comparison emitted, and the last offset something jumps to. Code
+  // before the jump target must not be rewritten.
+  int last_constant;
+  int last_comparison;
+  int jump_target;
+
+  // Offset of the last OP_CALL, so return can turn it into a tail call.
+  int last_call;
 } valp_compiler;
 
 typedef struct valp_class_compiler {
@@ -193,6 +204,7 @@ static void emit_return() {
 
 static uint8_t make_constant(valp_value value) {
   int constant = add_constant(current_bytecode(), value);
+  WRITE_BARRIER(current->function, value);
   if (constant > UINT8_MAX) {
     error("Too many constants in one chunk.");
     return 0;
@@ -201,7 +213,18 @@ static uint8_t make_constant(valp_value value) {
   return (uint8_t)constant;
 }
 
+static void emit_cache() {
+  int cache = add_inline_cache(current_bytecode());
+  if (cache > UINT16_MAX) {
+    error("Too many property accesses in one chunk.");
+  }
+
+  emit_byte((cache >> 8) & 0xff);
+  emit_byte(cache & 0xff);
+}
+
 static void emit_constant(valp_value value) {
+  current->last_constant = current_bytecode()->count;
   emit_bytes(OP_CONSTANT, make_constant(value));
 }
 
@@ -215,6 +238,7 @@ static void patch_jump(int offset) {
 
   current_bytecode()->code[offset] = (jump >> 8) & 0xff;
   current_bytecode()->code[offset + 1] = jump & 0xff;
+  current->jump_target = current_bytecode()->count;
 }
 
 static void init_compiler(valp_compiler *compiler, valp_function_type type) {
@@ -225,11 +249,16 @@ static void init_compiler(valp_compiler *compiler, valp_function_type type) {
   compiler->scope_depth = 0;
   compiler->function = new_function();
   compiler->loop = NULL;
+  compiler->last_constant = -1;
+  compiler->last_comparison = -1;
+  compiler->jump_target = 0;
+  compiler->last_call = -1;
 
   current = compiler;
 
   if (type != TYPE_SCRIPT) {
     current->function->name = copy_string(parser.previous.start, parser.previous.length);
+    WRITE_BARRIER(current->function, OBJ_VAL(current->function->name));
   }
 
   valp_local *local = &current->locals[current->local_count++];
@@ -245,9 +274,12 @@ static void init_compiler(valp_compiler *compiler, valp_function_type type) {
   }
 }
 
+static int max_stack_depth(valp_function *function);
+
 static valp_function *end_compiler() {
   emit_return();
   valp_function *function = current->function;
+  function->max_stack = max_stack_depth(function);
 #ifdef DEBUG_PRINT_CODE
   if (!parser.had_error) {
     disassemble_bytecode(current_bytecode(), function->name != NULL ? function->name->chars : "<script>");
@@ -281,25 +313,127 @@ static void expression();
 static void statement();
 static void declaration();
 static uint8_t identifier_constant(valp_token *name);
+static int global_variable(valp_token *name);
 static valp_parse_rule *get_rule(valp_token_type type);
 static void parse_precedence(valp_precedence precedence);
 
+// Returns the offset of the constant load the code emitted so far ends
+// with, or -1 if it doesn't end with one that can be rewritten.
+static int constant_tail() {
+  int offset = current->last_constant;
+  if (offset == -1 || offset < current->jump_target) return -1;
+
+  valp_bytecode *bytecode = current_bytecode();
+  int size = bytecode->code[offset] == OP_CONSTANT ? 2 : 1;
+  if (offset + size != bytecode->count) return -1;
+
+  return offset;
+}
+
+static valp_value constant_at(int offset) {
+  valp_bytecode *bytecode = current_bytecode();
+
+  switch (bytecode->code[offset]) {
+    case OP_TRUE:  return BOOL_VAL(true);
+    case OP_FALSE: return BOOL_VAL(false);
+    case OP_NIL:   return NIL_VAL;
+    default:       return bytecode->constants.values[bytecode->code[offset + 1]];
+  }
+}
+
+// Drops the code from offset on, which is a single constant load, along
+// with its constant table entry if nothing was added after it.
+static void discard_constant(int offset) {
+  valp_bytecode *bytecode = current_bytecode();
+
+  if (bytecode->code[offset] == OP_CONSTANT && bytecode->code[offset + 1] == bytecode->constants.count - 1) {
+    bytecode->constants.count--;
+  }
+
+  bytecode->count = offset;
+  current->last_constant = -1;
+}
+
+// Replaces the constant loads from offset on with a load of value.
+static void replace_constants(int offset, int second, valp_value value) {
+  push(value);
+  if (second != -1) discard_constant(second);
+  discard_constant(offset);
+
+  if (IS_BOOL(value)) {
+    current->last_constant = current_bytecode()->count;
+    emit_byte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  } else {
+    emit_constant(value);
+  }
+  pop();
+}
+
+// Evaluates a binary operator on two constants the way run() would. Returns
+// false when it would raise a runtime error, so the error stays at runtime.
+static bool fold_binary(valp_token_type operator_type, valp_value a, valp_value b, valp_value *result) {
+  switch (operator_type) {
+    case TOKEN_EQUAL_EQUAL: *result = BOOL_VAL(values_equal(a, b)); return true;
+    case TOKEN_BANG_EQUAL:  *result = BOOL_VAL(!values_equal(a, b)); return true;
+    default: break;
+  }
+
+  if (operator_type == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+    *result = OBJ_VAL(intern_string(concat_strings(AS_STRING(a), AS_STRING(b))));
+    return true;
+  }
+
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+
+  double x = AS_NUMBER(a);
+  double y = AS_NUMBER(b);
+
+  switch (operator_type) {
+    case TOKEN_PLUS:          *result = NUMBER_VAL(x + y); return true;
+    case TOKEN_MINUS:         *result = NUMBER_VAL(x - y); return true;
+    case TOKEN_STAR:          *result = NUMBER_VAL(x * y); return true;
+    case TOKEN_SLASH:         *result = NUMBER_VAL(x / y); return true;
+    case TOKEN_GREATER:       *result = BOOL_VAL(x > y); return true;
+    case TOKEN_LESS:          *result = BOOL_VAL(x < y); return true;
+    case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(!(x < y)); return true;
+    case TOKEN_LESS_EQUAL:    *result = BOOL_VAL(!(x > y)); return true;
+    default:
+      return false;
+  }
+}
+
+static void emit_comparison(uint8_t instruction) {
+  current->last_comparison = current_bytecode()->count;
+  emit_byte(instruction);
+}
+
 static void binary(bool can_assign) {
   // Remember the operator.
   valp_token_type operator_type = parser.previous.type;
+  int left = constant_tail();
+  int right_start = current_bytecode()->count;
 
   // Compile the right operand.
   valp_parse_rule *rule = get_rule(operator_type);
   parse_precedence((valp_precedence)(rule->precedence + 1));
 
+  int right = left == -1 ? -1 : constant_tail();
+  if (right != -1 && right == right_start && left >= current->jump_target) {
+    valp_value result;
+    if (fold_binary(operator_type, constant_at(left), constant_at(right), &result)) {
+      replace_constants(left, right, result);
+      return;
+    }
+  }
+
   // Emit the operator instruction.
   switch (operator_type) {
-    case TOKEN_BANG_EQUAL:    emit_bytes(OP_EQUAL, OP_NOT); break;
-    case TOKEN_EQUAL_EQUAL:   emit_byte(OP_EQUAL); break;
-    case TOKEN_GREATER:       emit_byte(OP_GREATER); break;
-    case TOKEN_GREATER_EQUAL: emit_bytes(OP_LESS, OP_NOT); break;
-    case TOKEN_LESS:          emit_byte(OP_LESS); break;
-    case TOKEN_LESS_EQUAL:    emit_bytes(OP_GREATER, OP_NOT); break;
+    case TOKEN_BANG_EQUAL:    emit_comparison(OP_NOT_EQUAL); break;
+    case TOKEN_EQUAL_EQUAL:   emit_comparison(OP_EQUAL); break;
+    case TOKEN_GREATER:       emit_comparison(OP_GREATER); break;
+    case TOKEN_GREATER_EQUAL: emit_comparison(OP_GREATER_EQUAL); break;
+    case TOKEN_LESS:          emit_comparison(OP_LESS); break;
+    case TOKEN_LESS_EQUAL:    emit_comparison(OP_LESS_EQUAL); break;
     case TOKEN_PLUS:          emit_byte(OP_ADD); break;
     case TOKEN_MINUS:         emit_byte(OP_SUBTRACT); break;
     case TOKEN_STAR:          emit_byte(OP_MULTIPLY); break;
@@ -327,6 +461,7 @@ static uint8_t argument_list() {
 
 static void call(bool can_assign) {
   uint8_t arg_count = argument_list();
+  current->last_call = current_bytecode()->count;
   emit_bytes(OP_CALL, arg_count);
 }
 
@@ -337,36 +472,49 @@ static void dot(bool can_assign) {
   if (can_assign && match(TOKEN_EQUAL)) {
     expression();
     emit_bytes(OP_SET_PROPERTY, name);
+    emit_cache();
   } else if (can_assign && match(TOKEN_PLUS_EQUAL)) {
     emit_bytes(OP_GET_PROPERTY_NO_POP, name);
+    emit_cache();
     expression();
     emit_byte(OP_ADD);
     emit_bytes(OP_SET_PROPERTY, name);
+    emit_cache();
   } else if (can_assign && match(TOKEN_MINUS_EQUAL)) {
     emit_bytes(OP_GET_PROPERTY_NO_POP, name);
+    emit_cache();
     expression();
     emit_byte(OP_SUBTRACT);
     emit_bytes(OP_SET_PROPERTY, name);
+    emit_cache();
   } else if (can_assign && match(TOKEN_SLASH_EQUAL)) {
     emit_bytes(OP_GET_PROPERTY_NO_POP, name);
+    emit_cache();
     expression();
     emit_byte(OP_DIVIDE);
     emit_bytes(OP_SET_PROPERTY, name);
+    emit_cache();
   } else if (can_assign && match(TOKEN_STAR_EQUAL)) {
     emit_bytes(OP_GET_PROPERTY_NO_POP, name);
+    emit_cache();
     expression();
     emit_byte(OP_MULTIPLY);
     emit_bytes(OP_SET_PROPERTY, name);
+    emit_cache();
   } else if (match(TOKEN_LEFT_PAREN)) {
     uint8_t arg_count = argument_list();
     emit_bytes(OP_INVOKE, name);
     emit_byte(arg_count);
+    emit_cache();
   } else {
     emit_bytes(OP_GET_PROPERTY, name);
+    emit_cache();
   }
 }
 
 static void literal(bool can_assign) {
+  current->last_constant = current_bytecode()->count;
+
   switch (parser.previous.type) {
     case TOKEN_FALSE: emit_byte(OP_FALSE); break;
     case TOKEN_NIL:   emit_byte(OP_NIL); break;
@@ -485,9 +633,9 @@ static void check_constant(uint8_t set_op, int arg) {
     if (upvalue.constant) {
       error("Cannot assign to a constant.");
     }
-  } else if (set_op == OP_SET_GLOBAL) {
+  } else if (set_op == OP_SET_GLOBAL_SLOT) {
     valp_value _;
-    if (hash_get(&vm.constants, AS_STRING(current_bytecode()->constants.values[arg]), &_)) {
+    if (hash_get(&vm.constants, AS_STRING(vm.global_names.values[arg]), &_)) {
       error("Cannot assign to a constant.");
     }
   }
@@ -510,6 +658,16 @@ static int resolve_upvalue(valp_compiler *compiler, valp_token *name) {
   return -1;
 }
 
+// Global slots take a two byte operand, everything else one byte.
+static void emit_variable_op(uint8_t op, int arg) {
+  if (op == OP_GET_GLOBAL_SLOT || op == OP_SET_GLOBAL_SLOT || op == OP_DEFINE_GLOBAL_SLOT) {
+    emit_byte(op);
+    emit_bytes((arg >> 8) & 0xff, arg & 0xff);
+  } else {
+    emit_bytes(op, (uint8_t)arg);
+  }
+}
+
 static void named_variable(valp_token name, bool can_assign) {
   uint8_t get_op, set_op;
   int arg = resolve_local(current, &name);
@@ -520,41 +678,41 @@ static void named_variable(valp_token name, bool can_assign) {
     get_op = OP_GET_UPVALUE;
     set_op = OP_SET_UPVALUE;
   } else {
-    arg = identifier_constant(&name);
-    get_op = OP_GET_GLOBAL;
-    set_op = OP_SET_GLOBAL;
+    arg = global_variable(&name);
+    get_op = OP_GET_GLOBAL_SLOT;
+    set_op = OP_SET_GLOBAL_SLOT;
   }
   
   if (can_assign && match(TOKEN_EQUAL)) {
     check_constant(set_op, arg);
     expression();
-    emit_bytes(set_op, (uint8_t)arg);
+    emit_variable_op(set_op, arg);
   } else if (can_assign && match(TOKEN_PLUS_EQUAL)) {
     check_constant(set_op, arg);
     named_variable(name, false);
     expression();
     emit_byte(OP_ADD);
-    emit_bytes(set_op, (uint8_t)arg);
+    emit_variable_op(set_op, arg);
   } else if (can_assign && match(TOKEN_MINUS_EQUAL)) {
     check_constant(set_op, arg);
     named_variable(name, false);
     expression();
     emit_byte(OP_SUBTRACT);
-    emit_bytes(set_op, (uint8_t)arg);
+    emit_variable_op(set_op, arg);
   } else if (can_assign && match(TOKEN_SLASH_EQUAL)) {
     check_constant(set_op, arg);
     named_variable(name, false);
     expression();
     emit_byte(OP_DIVIDE);
-    emit_bytes(set_op, (uint8_t)arg);
+    emit_variable_op(set_op, arg);
   } else if (can_assign && match(TOKEN_STAR_EQUAL)) {
     check_constant(set_op, arg);
     named_variable(name, false);
     expression();
     emit_byte(OP_MULTIPLY);
-    emit_bytes(set_op, (uint8_t)arg);
+    emit_variable_op(set_op, arg);
   } else {
-    emit_bytes(get_op, (uint8_t)arg);
+    emit_variable_op(get_op, arg);
   }
 }
 
@@ -601,11 +759,50 @@ static void self_(bool can_assign) {
   variable(false);
 }
 
+// The comparison that gives the opposite result for every pair of operands
+// run() accepts, or -1 if there is none.
+static int negated_comparison(uint8_t instruction) {
+  switch (instruction) {
+    case OP_EQUAL:         return OP_NOT_EQUAL;
+    case OP_NOT_EQUAL:     return OP_EQUAL;
+    case OP_LESS:          return OP_GREATER_EQUAL;
+    case OP_GREATER_EQUAL: return OP_LESS;
+    case OP_GREATER:       return OP_LESS_EQUAL;
+    case OP_LESS_EQUAL:    return OP_GREATER;
+    default:               return -1;
+  }
+}
+
 static void unary(bool can_assign) {
   valp_token_type operator_type = parser.previous.type;
+  int operand_start = current_bytecode()->count;
 
   parse_precedence(PREC_UNARY);
 
+  int operand = constant_tail();
+  if (operand != -1 && operand == operand_start) {
+    valp_value value = constant_at(operand);
+
+    if (operator_type == TOKEN_BANG) {
+      replace_constants(operand, -1, BOOL_VAL(is_falsey(value)));
+      return;
+    } else if (operator_type == TOKEN_MINUS && IS_NUMBER(value)) {
+      replace_constants(operand, -1, NUMBER_VAL(-AS_NUMBER(value)));
+      return;
+    }
+  }
+
+  valp_bytecode *bytecode = current_bytecode();
+  int comparison = current->last_comparison;
+  if (operator_type == TOKEN_BANG && comparison == bytecode->count - 1 &&
+      comparison >= operand_start && comparison >= current->jump_target) {
+    int negated = negated_comparison(bytecode->code[comparison]);
+    if (negated != -1) {
+      bytecode->code[comparison] = (uint8_t)negated;
+      return;
+    }
+  }
+
   switch (operator_type) {
     case TOKEN_BANG:  emit_byte(OP_NOT); break;
     case TOKEN_MINUS: emit_byte(OP_NEGATE); break;
@@ -691,6 +888,20 @@ static uint8_t identifier_constant(valp_token *name) {
   return make_constant(OBJ_VAL(copy_string(name->start, name->length)));
 }
 
+static int global_variable(valp_token *name) {
+  valp_string *string = copy_string(name->start, name->length);
+  push(OBJ_VAL(string));
+  int slot = global_slot(string);
+  pop();
+
+  if (slot > UINT16_MAX) {
+    error("Too many global variables.");
+    return 0;
+  }
+
+  return slot;
+}
+
 static void add_local(valp_token name) {
   if (current->local_count == UINT8_COUNT) {
     error("Too many local variables in function.");
@@ -722,13 +933,13 @@ static void declare_variable() {
   add_local(*name);
 }
 
-static uint8_t parse_variable(const char *errorMessage) {
+static int parse_variable(const char *errorMessage) {
   consume(TOKEN_IDENTIFIER, errorMessage);
 
   declare_variable();
   if (current->scope_depth > 0) return 0;
 
-  return identifier_constant(&parser.previous);
+  return global_variable(&parser.previous);
 }
 
 static void mark_initialized(bool constant) {
@@ -736,17 +947,17 @@ static void mark_initialized(bool constant) {
   current->locals[current->local_count - 1].constant = constant;
 }
 
-static void define_variable(uint8_t global, bool constant) {
+static void define_variable(int global, bool constant) {
   if (current->scope_depth == 0) {
     if (constant) {
-      hash_set(&vm.constants, AS_STRING(current_bytecode()->constants.values[global]), NIL_VAL);
+      hash_set(&vm.constants, AS_STRING(vm.global_names.values[global]), NIL_VAL);
     }
   } else {
     mark_initialized(constant);
     return;
   }
 
-  emit_bytes(OP_DEFINE_GLOBAL, global);
+  emit_variable_op(OP_DEFINE_GLOBAL_SLOT, global);
 }
 
 static valp_parse_rule *get_rule(valp_token_type type) {
@@ -774,6 +985,9 @@ static int get_arg_count(uint8_t *code, const valp_value_array constants, int ip
         case OP_EQUAL:
         case OP_GREATER:
         case OP_LESS:
+        case OP_NOT_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
         case OP_ADD:
         case OP_SUBTRACT:
         case OP_MULTIPLY:
@@ -785,36 +999,48 @@ static int get_arg_count(uint8_t *code, const valp_value_array constants, int ip
         case OP_BREAK:
         case OP_DUP:
         case OP_PRINT:
+        case OP_ADD_NUM:
+        case OP_ADD_STR:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE_NUM:
+        case OP_GREATER_NUM:
+        case OP_LESS_NUM:
+        case OP_GREATER_EQUAL_NUM:
+        case OP_LESS_EQUAL_NUM:
           return 0;
 
         case OP_CONSTANT:
         case OP_GET_LOCAL:
         case OP_SET_LOCAL:
-        case OP_GET_GLOBAL:
-        case OP_SET_GLOBAL:
-        case OP_DEFINE_GLOBAL:
         case OP_GET_UPVALUE:
         case OP_SET_UPVALUE:
-        case OP_GET_PROPERTY:
-        case OP_GET_PROPERTY_NO_POP:
-        case OP_SET_PROPERTY:
         case OP_GET_SUPER:
         case OP_METHOD:
         case OP_NEW_ARRAY:
+        case OP_CLASS:
+        case OP_CALL:
+        case OP_TAIL_CALL:
           return 1;
 
         case OP_JUMP:
         case OP_JUMP_COMPARE:
         case OP_JUMP_IF_FALSE:
         case OP_LOOP:
-        case OP_CLASS:
-        case OP_CALL:
+        case OP_SUPER_INVOKE:
+        case OP_GET_GLOBAL_SLOT:
+        case OP_SET_GLOBAL_SLOT:
+        case OP_DEFINE_GLOBAL_SLOT:
           return 2;
 
-        case OP_INVOKE:
-        case OP_SUPER_INVOKE:
+        case OP_GET_PROPERTY:
+        case OP_GET_PROPERTY_NO_POP:
+        case OP_SET_PROPERTY:
           return 3;
 
+        case OP_INVOKE:
+          return 4;
+
         case OP_CLOSURE: {
           int constant = code[ip + 1];
           valp_function* loadedFn = AS_FUNCTION(constants.values[constant]);
@@ -825,8 +1051,120 @@ static int get_arg_count(uint8_t *code, const valp_value_array constants, int ip
     return 0;
 }
 
+// How many values an instruction leaves on the stack minus how many it
+// takes, when it falls through to the next one.
+static int stack_effect(uint8_t *code, int ip) {
+  switch (code[ip]) {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL_SLOT:
+    case OP_GET_UPVALUE:
+    case OP_GET_PROPERTY_NO_POP:
+    case OP_CLOSURE:
+    case OP_CLASS:
+    case OP_DUP:
+      return 1;
+
+    case OP_POP:
+    case OP_DEFINE_GLOBAL_SLOT:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_NOT_EQUAL:
+    case OP_GREATER_EQUAL:
+    case OP_LESS_EQUAL:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_SUBTRACT_NUM:
+    case OP_MULTIPLY_NUM:
+    case OP_DIVIDE_NUM:
+    case OP_GREATER_NUM:
+    case OP_LESS_NUM:
+    case OP_GREATER_EQUAL_NUM:
+    case OP_LESS_EQUAL_NUM:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_RETURN:
+    case OP_INHERIT:
+    case OP_METHOD:
+    case OP_SLICE:
+      return -1;
+
+    // Both values go when they are equal, the jump only drops the case.
+    case OP_JUMP_COMPARE:
+      return -2;
+
+    // The callee and the arguments become the result.
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      return -code[ip + 1];
+    case OP_INVOKE:
+      return -code[ip + 2];
+    case OP_SUPER_INVOKE:
+      return -code[ip + 2] - 1;
+
+    case OP_NEW_ARRAY:
+      return 1 - code[ip + 1];
+
+    default:
+      return 0;
+  }
+}
+
+// Code paths only meet at jump targets, and every jump but OP_LOOP goes
+// forward, so a single pass in order knows the depth at a target before it
+// gets there. Code after a return or jump nobody lands on is still counted,
+// as if it ran, which can only overestimate.
+static int max_stack_depth(valp_function *function) {
+  valp_bytecode *bytecode = &function->bytecode;
+  uint8_t *code = bytecode->code;
+
+  int *target_depth = ALLOCATE(int, bytecode->count + 1);
+  for (int i = 0; i <= bytecode->count; i++) target_depth[i] = 0;
+
+  int depth = function->arity + 1;
+  int max = depth;
+
+  for (int ip = 0; ip < bytecode->count; ip += 1 + get_arg_count(code, bytecode->constants, ip)) {
+    if (target_depth[ip] > depth) depth = target_depth[ip];
+
+    switch (code[ip]) {
+      case OP_JUMP:
+      case OP_JUMP_IF_FALSE:
+      case OP_JUMP_COMPARE: {
+        int target = ip + 3 + ((code[ip + 1] << 8) | code[ip + 2]);
+        int landing = code[ip] == OP_JUMP_COMPARE ? depth - 1 : depth;
+        if (target <= bytecode->count && landing > target_depth[target]) {
+          target_depth[target] = landing;
+        }
+        break;
+      }
+      // The array is pushed before the elements are taken off.
+      case OP_NEW_ARRAY:
+        if (depth + 1 > max) max = depth + 1;
+        break;
+    }
+
+    depth += stack_effect(code, ip);
+    if (depth > max) max = depth;
+  }
+
+  FREE_ARRAY(int, target_depth, bytecode->count + 1);
+  return max;
+}
+
 static void start_loop(valp_loop *loop) {
   loop->start = current_bytecode()->count;
+  current->jump_target = loop->start;
   loop->enclosing = current->loop;
   loop->scope_depth = current->scope_depth;
   current->loop = loop;
@@ -904,7 +1242,7 @@ static void function(valp_function_type type) {
         error_at_current("Can't have more than 255 parametets.");
       }
 
-      uint8_t param_constant = parse_variable("Expect parametr name.");
+      int param_constant = parse_variable("Expect parametr name.");
       define_variable(param_constant, false);
     } while (match(TOKEN_COMMA));
   }
@@ -946,9 +1284,10 @@ static void class_declaration() {
 
   uint8_t name_constant = identifier_constant(&parser.previous);
   declare_variable();
+  int global = current->scope_depth > 0 ? 0 : global_variable(&class_name);
 
   emit_bytes(OP_CLASS, name_constant);
-  define_variable(name_constant, false);
+  define_variable(global, false);
 
   valp_class_compiler class_compiler;
   class_compiler.has_superclass = false;
@@ -987,14 +1326,14 @@ static void class_declaration() {
 }
 
 static void fun_declaration() {
-  uint8_t global = parse_variable("Expect function name.");
+  int global = parse_variable("Expect function name.");
   mark_initialized(false);
   function(TYPE_FUNCTION);
   define_variable(global, false);
 }
 
 static void var_declaration(bool constant) {
-  uint8_t global = parse_variable("Expect variable name.");
+  int global = parse_variable("Expect variable name.");
 
   if (match(TOKEN_EQUAL)) {
     expression();
@@ -1168,6 +1507,14 @@ static void return_statement() {
 
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+
+    // A call whose result is returned right away can reuse the frame. The
+    // OP_RETURN stays, both for paths that jump over the call and for
+    // callees that don't push a frame of their own.
+    if (current->last_call != -1 && current->last_call == current_bytecode()->count - 2) {
+      current_bytecode()->code[current->last_call] = OP_TAIL_CALL;
+    }
+
     emit_byte(OP_RETURN);
   }
 }
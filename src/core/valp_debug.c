@@ -3,6 +3,7 @@
 #include "valp_debug.h"
 #include "valp_object.h"
 #include "valp_value.h"
+#include "valp_vm.h"
 
 void disassemble_bytecode(valp_bytecode *bytecode, const char *name) {
   printf("== %s ==\n", name);
@@ -30,6 +31,25 @@ static int invoke_instruction(const char* name, valp_bytecode* bytecode, int off
   return offset + 3;
 }
 
+static int cached_invoke_instruction(const char* name, valp_bytecode* bytecode, int offset) {
+  uint8_t constant = bytecode->code[offset + 1];
+  uint8_t arg_count = bytecode->code[offset + 2];
+  uint16_t cache = (uint16_t)((bytecode->code[offset + 3] << 8) | bytecode->code[offset + 4]);
+  printf("%-16s (%d args) %4d '", name, arg_count, constant);
+  print_value(bytecode->constants.values[constant]);
+  printf("' cache %d\n", cache);
+  return offset + 5;
+}
+
+static int property_instruction(const char *name, valp_bytecode *bytecode, int offset) {
+  uint8_t constant = bytecode->code[offset + 1];
+  uint16_t cache = (uint16_t)((bytecode->code[offset + 2] << 8) | bytecode->code[offset + 3]);
+  printf("%-16s %4d '", name, constant);
+  print_value(bytecode->constants.values[constant]);
+  printf("' cache %d\n", cache);
+  return offset + 4;
+}
+
 
 static int simple_instruction(const char* name, int offset) {
   printf("%s\n", name);
@@ -42,6 +62,14 @@ static int byte_instruction(const char *name, valp_bytecode *bytecode, int offse
   return offset + 2;
 }
 
+static int global_instruction(const char *name, valp_bytecode *bytecode, int offset) {
+  uint16_t slot = (uint16_t)((bytecode->code[offset + 1] << 8) | bytecode->code[offset + 2]);
+  printf("%-16s %4d '", name, slot);
+  print_value(vm.global_names.values[slot]);
+  printf("'\n");
+  return offset + 3;
+}
+
 static int jump_instruction(const char *name, int sign, valp_bytecode *bytecode, int offset) {
   uint16_t jump = (uint16_t)(bytecode->code[offset + 1] << 8);
   jump |= bytecode->code[offset + 2];
@@ -67,18 +95,21 @@ int disassemble_instruction(valp_bytecode *bytecode, int offset) {
     case OP_POP:                      return simple_instruction("OP_POP", offset);
     case OP_GET_LOCAL:                return byte_instruction("OP_GET_LOCAL", bytecode, offset);
     case OP_SET_LOCAL:                return byte_instruction("OP_SET_LOCAL", bytecode, offset);
-    case OP_GET_GLOBAL:               return constant_instruction("OP_GET_GLOBAL", bytecode, offset);
-    case OP_DEFINE_GLOBAL:            return constant_instruction("OP_DEFINE_GLOBAL", bytecode, offset);
-    case OP_SET_GLOBAL:               return constant_instruction("OP_SET_GLOBAL", bytecode, offset);
+    case OP_GET_GLOBAL_SLOT:          return global_instruction("OP_GET_GLOBAL_SLOT", bytecode, offset);
+    case OP_DEFINE_GLOBAL_SLOT:       return global_instruction("OP_DEFINE_GLOBAL_SLOT", bytecode, offset);
+    case OP_SET_GLOBAL_SLOT:          return global_instruction("OP_SET_GLOBAL_SLOT", bytecode, offset);
     case OP_GET_UPVALUE:              return byte_instruction("OP_GET_UPVALUE", bytecode, offset);
     case OP_SET_UPVALUE:              return byte_instruction("OP_SET_UPVALUE", bytecode, offset);
-    case OP_GET_PROPERTY:             return constant_instruction("OP_GET_PROPERTY", bytecode, offset);
-    case OP_SET_PROPERTY:             return constant_instruction("OP_SET_PROPERTY", bytecode, offset);
-    case OP_GET_PROPERTY_NO_POP:      return constant_instruction("OP_GET_PROPERTY_NO_POP", bytecode, offset);
+    case OP_GET_PROPERTY:             return property_instruction("OP_GET_PROPERTY", bytecode, offset);
+    case OP_SET_PROPERTY:             return property_instruction("OP_SET_PROPERTY", bytecode, offset);
+    case OP_GET_PROPERTY_NO_POP:      return property_instruction("OP_GET_PROPERTY_NO_POP", bytecode, offset);
     case OP_GET_SUPER:                return constant_instruction("OP_GET_SUPER", bytecode, offset);
     case OP_EQUAL:                    return simple_instruction("OP_EQUAL", offset);
     case OP_GREATER:                  return simple_instruction("OP_GREATER", offset);
     case OP_LESS:                     return simple_instruction("OP_LESS", offset);
+    case OP_NOT_EQUAL:                return simple_instruction("OP_NOT_EQUAL", offset);
+    case OP_GREATER_EQUAL:            return simple_instruction("OP_GREATER_EQUAL", offset);
+    case OP_LESS_EQUAL:               return simple_instruction("OP_LESS_EQUAL", offset);
     case OP_ADD:                      return simple_instruction("OP_ADD", offset);
     case OP_SUBTRACT:                 return simple_instruction("OP_SUBTRACT", offset);
     case OP_MULTIPLY:                 return simple_instruction("OP_MULTIPLY", offset);
@@ -91,7 +122,8 @@ int disassemble_instruction(valp_bytecode *bytecode, int offset) {
     case OP_JUMP_COMPARE:             return jump_instruction("OP_JUMP_COMPARE", 1, bytecode, offset);
     case OP_LOOP:                     return jump_instruction("OP_LOOP", -1, bytecode, offset);
     case OP_CALL:                     return byte_instruction("OP_CALL", bytecode, offset);
-    case OP_INVOKE:                   return invoke_instruction("OP_INVOKE", bytecode, offset);
+    case OP_TAIL_CALL:                return byte_instruction("OP_TAIL_CALL", bytecode, offset);
+    case OP_INVOKE:                   return cached_invoke_instruction("OP_INVOKE", bytecode, offset);
     case OP_SUPER_INVOKE:             return invoke_instruction("OP_SUPER_INVOKE", bytecode, offset);
     case OP_CLOSURE: {
       offset++;
@@ -116,6 +148,15 @@ int disassemble_instruction(valp_bytecode *bytecode, int offset) {
     case OP_METHOD:         return constant_instruction("OP_METHOD", bytecode, offset);
     case OP_DUP:            return simple_instruction("OP_DUP", offset);
     case OP_NEW_ARRAY:      return simple_instruction("OP_NEW_ARRAY", offset);
+    case OP_ADD_NUM:        return simple_instruction("OP_ADD_NUM", offset);
+    case OP_ADD_STR:        return simple_instruction("OP_ADD_STR", offset);
+    case OP_SUBTRACT_NUM:   return simple_instruction("OP_SUBTRACT_NUM", offset);
+    case OP_MULTIPLY_NUM:   return simple_instruction("OP_MULTIPLY_NUM", offset);
+    case OP_DIVIDE_NUM:     return simple_instruction("OP_DIVIDE_NUM", offset);
+    case OP_GREATER_NUM:    return simple_instruction("OP_GREATER_NUM", offset);
+    case OP_LESS_NUM:       return simple_instruction("OP_LESS_NUM", offset);
+    case OP_GREATER_EQUAL_NUM: return simple_instruction("OP_GREATER_EQUAL_NUM", offset);
+    case OP_LESS_EQUAL_NUM: return simple_instruction("OP_LESS_EQUAL_NUM", offset);
     default:
       printf("Unknown opcode %d\n", instruction);
       return offset + 1;
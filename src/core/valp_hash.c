@@ -1,116 +1,288 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "valp_memory.h"
 #include "valp_object.h"
 #include "valp_hash.h"
 #include "valp_value.h"
+#include "valp_vm.h"
 
 #define HASH_MAX_LOAD 0.75
+// Tables shrink once fewer than this share of their slots is live, to where
+// about half of them are.
+#define HASH_MIN_LOAD 0.25
+
+// Control bytes compared at once, and the smallest table.
+#define HASH_GROUP 16
+
+// Full slots hold a tag below 0x80, so the high bit marks free slots.
+#define CONTROL_EMPTY   ((uint8_t)0x80)
+#define CONTROL_DELETED ((uint8_t)0xfe)
+#define IS_FULL(control) ((control) < 0x80)
+
+// The low 7 bits of a hash tag its slot, the rest pick where probing starts.
+#define HASH_TAG(hash)   ((uint8_t)((hash) & 0x7f))
+#define HASH_START(hash) ((hash) >> 7)
+
+// Bit i of the result is set when byte i of the group equals byte.
+#ifdef __SSE2__
+static inline uint32_t group_match(const uint8_t *group, uint8_t byte) {
+  __m128i control = _mm_loadu_si128((const __m128i*)group);
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char)byte)));
+}
+
+// Empty and deleted slots, whose high bit is set.
+static inline uint32_t group_free(const uint8_t *group) {
+  return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+}
+#else
+static inline uint32_t group_match(const uint8_t *group, uint8_t byte) {
+  uint32_t mask = 0;
+  for (int i = 0; i < HASH_GROUP; i++) mask |= (uint32_t)(group[i] == byte) << i;
+  return mask;
+}
+
+static inline uint32_t group_free(const uint8_t *group) {
+  uint32_t mask = 0;
+  for (int i = 0; i < HASH_GROUP; i++) mask |= (uint32_t)(group[i] >> 7) << i;
+  return mask;
+}
+#endif
+
+// Size of the allocation behind a table with this many slots.
+static size_t table_size(int slots) {
+  return slots + HASH_GROUP + slots * (sizeof(valp_string*) + sizeof(valp_value));
+}
 
 void init_hash(valp_hash *hash) {
   hash->count = 0;
+  hash->tombstones = 0;
   hash->capacity = -1;
-  hash->entries = NULL;
+  hash->control = NULL;
+  hash->keys = NULL;
+  hash->values = NULL;
+  hash->owner = NULL;
 }
 
 void free_hash(valp_hash *hash) {
-  FREE_ARRAY(valp_entry, hash->entries, hash->capacity + 1);
+  if (hash->capacity >= 0) {
+    FREE_ARRAY(uint8_t, hash->control, table_size(hash->capacity + 1));
+  }
   init_hash(hash);
 }
 
-static valp_entry *find_entry(valp_entry *entries, int capacity, valp_string *key) {
-  uint32_t index = key->hash & capacity;
+static void set_control(valp_hash *hash, int slot, uint8_t control) {
+  hash->control[slot] = control;
+  if (slot < HASH_GROUP) hash->control[hash->capacity + 1 + slot] = control;
+}
 
-  valp_entry *tombstone = NULL;
-  for (;;) {
-    valp_entry *entry = &entries[index];
+// Groups are probed at growing distances, which visits every group of a
+// power of two sized table.
+#define FOR_EACH_GROUP(hash, string_hash, pos) \
+  for (int pos = HASH_START(string_hash) & (hash)->capacity, step_ = HASH_GROUP;; \
+       pos = (pos + step_) & (hash)->capacity, step_ += HASH_GROUP)
 
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) {
-        // Empty entry.
-        return tombstone != NULL ? tombstone : entry;
-      } else {
-        // We found a tombstone;
-        if (tombstone == NULL) tombstone = entry;
-      }
-    } else if (entry->key == key) {
-      // We gound the key.
-      return entry;
+// The slot holding key, or -1.
+static int find_slot(valp_hash *hash, valp_string *key) {
+  uint8_t tag = HASH_TAG(key->hash);
+
+  // Most keys sit in the slot probing starts at, try it before the group.
+  int home = HASH_START(key->hash) & hash->capacity;
+  if (hash->keys[home] == key) return home;
+
+  FOR_EACH_GROUP(hash, key->hash, pos) {
+    const uint8_t *group = hash->control + pos;
+
+    for (uint32_t match = group_match(group, tag); match != 0; match &= match - 1) {
+      int slot = (pos + __builtin_ctz(match)) & hash->capacity;
+      if (hash->keys[slot] == key) return slot;
     }
 
-    index = (index + 1) & capacity;
+    if (group_match(group, CONTROL_EMPTY) != 0) return -1;
+  }
+}
+
+// The first empty or deleted slot on the probe path of a hash.
+static int find_free(valp_hash *hash, uint32_t string_hash) {
+  FOR_EACH_GROUP(hash, string_hash, pos) {
+    uint32_t free_slots = group_free(hash->control + pos);
+    if (free_slots != 0) return (pos + __builtin_ctz(free_slots)) & hash->capacity;
   }
 }
 
 bool hash_get(valp_hash *hash, valp_string *key, valp_value *value) {
   if (hash->count == 0) return false;
 
-  valp_entry *entry = find_entry(hash->entries, hash->capacity, key);
-  if (entry->key == NULL) return false;
+  int slot = find_slot(hash, key);
+  if (slot == -1) return false;
 
-  *value = entry->value;
+  *value = hash->values[slot];
   return true;
 }
 
-static void adjust_capacity(valp_hash *hash, int capacity) {
-  valp_entry *entries = ALLOCATE(valp_entry, capacity + 1);
-  hash->count = 0;
-  for (int i = 0; i <= capacity; i++) {
-    entries[i].key = NULL;
-    entries[i].value = NIL_VAL;
+// Moves the entries to a table with this many slots. The collector resizes
+// tables while it runs, when may_collect is false.
+static void adjust_capacity(valp_hash *hash, int slots, bool may_collect) {
+  size_t size = table_size(slots);
+  uint8_t *block = may_collect ? ALLOCATE(uint8_t, size) : gc_allocate(size);
+
+  valp_hash old = *hash;
+  hash->control = block;
+  hash->keys = (valp_string**)(block + slots + HASH_GROUP);
+  hash->values = (valp_value*)(hash->keys + slots);
+  hash->capacity = slots - 1;
+  hash->tombstones = 0;
+  memset(hash->control, CONTROL_EMPTY, slots + HASH_GROUP);
+  memset(hash->keys, 0, sizeof(valp_string*) * slots);
+
+  for (int i = 0; i <= old.capacity; i++) {
+    if (!IS_FULL(old.control[i])) continue;
+
+    valp_string *key = old.keys[i];
+    int slot = find_free(hash, key->hash);
+    set_control(hash, slot, HASH_TAG(key->hash));
+    hash->keys[slot] = key;
+    hash->values[slot] = old.values[i];
   }
 
-  for (int i = 0; i <= hash->capacity; i++) {
-    valp_entry *entry = &hash->entries[i];
-    if (entry->key == NULL) continue;
+  if (old.capacity >= 0) {
+    FREE_ARRAY(uint8_t, old.control, table_size(old.capacity + 1));
+  }
+}
 
-    valp_entry *dest = find_entry(entries, capacity, entry->key);
-    dest->key = entry->key;
-    dest->value = entry->value;
-    hash->count++;
+// Rehashes without allocating, turning every deleted slot back into an
+// empty one. Live slots are first marked deleted, meaning not placed yet,
+// then each moves to the first free slot on its probe path. When that slot
+// is also waiting, the two swap and the one moved in is placed next.
+static void rehash_in_place(valp_hash *hash) {
+  int slots = hash->capacity + 1;
+  for (int i = 0; i < slots; i++) {
+    hash->control[i] = IS_FULL(hash->control[i]) ? CONTROL_DELETED : CONTROL_EMPTY;
+  }
+  memcpy(hash->control + slots, hash->control, HASH_GROUP);
+
+  for (int i = 0; i < slots; i++) {
+    if (hash->control[i] != CONTROL_DELETED) continue;
+
+    valp_string *key = hash->keys[i];
+    uint8_t tag = HASH_TAG(key->hash);
+    int start = HASH_START(key->hash) & hash->capacity;
+    int slot = find_free(hash, key->hash);
+
+    // Probing reaches both slots in the same group, the key can stay.
+    if (((slot - start) & hash->capacity) / HASH_GROUP ==
+        ((i - start) & hash->capacity) / HASH_GROUP) {
+      set_control(hash, i, tag);
+      continue;
+    }
+
+    valp_value value = hash->values[i];
+    if (hash->control[slot] == CONTROL_EMPTY) {
+      set_control(hash, slot, tag);
+      set_control(hash, i, CONTROL_EMPTY);
+      hash->keys[i] = NULL;
+      hash->values[i] = NIL_VAL;
+    } else {
+      set_control(hash, slot, tag);
+      hash->keys[i] = hash->keys[slot];
+      hash->values[i] = hash->values[slot];
+      i--;
+    }
+    hash->keys[slot] = key;
+    hash->values[slot] = value;
   }
 
-  FREE_ARRAY(valp_entry, hash->entries, hash->capacity + 1);
-  hash->entries = entries;
-  hash->capacity = capacity;
+  hash->tombstones = 0;
+}
+
+// Gives memory back once a table falls below the low-water mark, or drops
+// the deleted slots when they outnumber the live ones.
+static void tidy(valp_hash *hash, bool may_collect) {
+  int slots = hash->capacity + 1;
+
+  if (slots > HASH_GROUP && hash->count < slots * HASH_MIN_LOAD) {
+    int fit = HASH_GROUP;
+    while (hash->count > fit / 2) fit *= 2;
+    adjust_capacity(hash, fit, may_collect);
+  } else if (hash->tombstones > hash->count) {
+    rehash_in_place(hash);
+  }
 }
 
 bool hash_set(valp_hash *hash, valp_string *key, valp_value value) {
-  if (hash->count + 1 > (hash->capacity + 1) * HASH_MAX_LOAD) {
-    int capacity = GROW_CAPACITY(hash->capacity + 1) - 1;
-    adjust_capacity(hash, capacity);
+  int slot = hash->count == 0 ? -1 : find_slot(hash, key);
+  bool is_new_key = slot == -1;
+
+  if (is_new_key) {
+    // Deleted slots count against the load, probes have to pass them. When
+    // they make up most of it, clearing them is enough.
+    int slots = hash->capacity + 1;
+    if (hash->count + hash->tombstones + 1 > slots * HASH_MAX_LOAD) {
+      if (hash->tombstones > hash->count) {
+        rehash_in_place(hash);
+      } else {
+        adjust_capacity(hash, slots == 0 ? HASH_GROUP : slots * 2, true);
+      }
+    }
+
+    slot = find_free(hash, key->hash);
+    if (hash->control[slot] == CONTROL_DELETED) hash->tombstones--;
+    hash->count++;
+    set_control(hash, slot, HASH_TAG(key->hash));
+    hash->keys[slot] = key;
   }
 
-  valp_entry *entry = find_entry(hash->entries, hash->capacity, key);
+  hash->values[slot] = value;
 
-  bool is_new_key = entry->key == NULL;
-  if (is_new_key && IS_NIL(entry->value)) hash->count++;
+  if (hash->owner != NULL) {
+    WRITE_BARRIER(hash->owner, OBJ_VAL(key));
+    WRITE_BARRIER(hash->owner, value);
+  }
 
-  entry->key = key;
-  entry->value = value;
   return is_new_key;
 }
 
+// Deleted slots keep probes going past them, unlike empty ones. A probe
+// only goes past a slot when some group holding it had no empty slot, so
+// with empty slots less than a group apart on either side the slot can be
+// emptied outright.
+static void delete_slot(valp_hash *hash, int slot) {
+  int before = (slot - HASH_GROUP) & hash->capacity;
+  uint32_t empty_after = group_match(hash->control + slot, CONTROL_EMPTY);
+  uint32_t empty_before = group_match(hash->control + before, CONTROL_EMPTY);
+  bool emptied = empty_after != 0 && empty_before != 0 &&
+      __builtin_ctz(empty_after) + __builtin_clz(empty_before << 16) < HASH_GROUP;
+
+  if (emptied) {
+    set_control(hash, slot, CONTROL_EMPTY);
+  } else {
+    set_control(hash, slot, CONTROL_DELETED);
+    hash->tombstones++;
+  }
+  hash->count--;
+  hash->keys[slot] = NULL;
+  hash->values[slot] = NIL_VAL;
+}
+
 bool hash_delete(valp_hash *hash, valp_string *key) {
   if (hash->count == 0) return false;
 
-  // Find the entry.
-  valp_entry *entry = find_entry(hash->entries, hash->capacity, key);
-  if (entry->key == NULL) return false;
-
-  // Place a tombstone in the entry.
-  entry->key = NULL;
-  entry->value = BOOL_VAL(true);
+  int slot = find_slot(hash, key);
+  if (slot == -1) return false;
 
+  delete_slot(hash, slot);
+  tidy(hash, true);
   return true;
 }
 
 void hash_add_all(valp_hash *from, valp_hash *to) {
   for (int i = 0; i <= from->capacity; i++) {
-    valp_entry *entry = &from->entries[i];
-    if (entry->key != NULL) {
-      hash_set(to, entry->key, entry->value);
+    if (IS_FULL(from->control[i])) {
+      hash_set(to, from->keys[i], from->values[i]);
     }
   }
 }
@@ -118,37 +290,50 @@ void hash_add_all(valp_hash *from, valp_hash *to) {
 valp_string *hash_find_string(valp_hash *hash, const char *chars, int length, uint32_t string_hash) {
   if (hash->count == 0) return NULL;
 
-  uint32_t index = string_hash & hash->capacity;
+  uint8_t tag = HASH_TAG(string_hash);
 
-  for (;;) {
-    valp_entry *entry = &hash->entries[index];
+  FOR_EACH_GROUP(hash, string_hash, pos) {
+    const uint8_t *group = hash->control + pos;
 
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) return NULL;
-    } else if (entry->key->length == length && entry->key->hash == string_hash &&
-      memcmp(entry->key->chars, chars, length) == 0) {
-
-      return entry->key;    
+    for (uint32_t match = group_match(group, tag); match != 0; match &= match - 1) {
+      valp_string *key = hash->keys[(pos + __builtin_ctz(match)) & hash->capacity];
+      if (key->length == length && key->hash == string_hash &&
+          memcmp(key->chars, chars, length) == 0) {
+        return key;
+      }
     }
 
-    index = (index + 1) & hash->capacity;
+    if (group_match(group, CONTROL_EMPTY) != 0) return NULL;
   }
 }
 
 void hash_remove_white(valp_hash *hash) {
   for (int i = 0; i <= hash->capacity; i++) {
-    valp_entry *entry = &hash->entries[i];
-
-    if (entry->key != NULL && !entry->key->obj.is_marked) {
-      hash_delete(hash, entry->key);
+    if (IS_FULL(hash->control[i]) && is_white(&hash->keys[i]->obj)) {
+      delete_slot(hash, i);
     }
   }
+
+  tidy(hash, false);
+}
+
+// Moved keys keep their hash, so they stay in their slots.
+void forward_hash(valp_hash *hash) {
+  hash->owner = forward_object(hash->owner);
+
+  for (int i = 0; i <= hash->capacity; i++) {
+    if (!IS_FULL(hash->control[i])) continue;
+
+    hash->keys[i] = (valp_string*)forward_object((valp_obj*)hash->keys[i]);
+    forward_value(&hash->values[i]);
+  }
 }
 
 void mark_hash(valp_hash *hash) {
   for (int i = 0; i <= hash->capacity; i++) {
-    valp_entry *entry = &hash->entries[i];
-    mark_object((valp_obj*)entry->key);
-    mark_value(entry->value);
+    if (!IS_FULL(hash->control[i])) continue;
+
+    mark_object((valp_obj*)hash->keys[i]);
+    mark_value(hash->values[i]);
   }
-}
\ No newline at end of file
+}
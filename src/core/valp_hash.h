@@ -4,15 +4,26 @@
 #include "../include/valp.h"
 #include "valp_value.h"
 
+// An open addressing table in the style of a Swiss table. Each slot has a
+// control byte, which holds 7 bits of the hash of its key or marks it as
+// empty or deleted. Probing compares a group of 16 control bytes at once
+// and only looks at the keys whose tag matches. Keys and values live in
+// arrays of their own, after the control bytes in the same allocation.
 typedef struct {
-  valp_string *key;
-  valp_value value;
-} valp_entry;
-
-typedef struct {
+  // Live entries.
   int count;
+  // Deleted slots, which probes still step over until the next rehash.
+  int tombstones;
+  // Slots minus one, a mask for hashes. -1 while nothing is allocated.
   int capacity;
-  valp_entry *entries;
+  // The first group of control bytes is repeated after the last slot, so a
+  // group can be loaded starting at any slot.
+  uint8_t *control;
+  valp_string **keys;
+  valp_value *values;
+  // The object the hash belongs to, for the write barrier in hash_set().
+  // NULL for the VM's own tables.
+  valp_obj *owner;
 } valp_hash;
 
 void init_hash(valp_hash *hash);
@@ -24,5 +35,6 @@ void hash_add_all(valp_hash *from, valp_hash *to);
 valp_string *hash_find_string(valp_hash *hash, const char *chars, int length, uint32_t string_hash);
 void hash_remove_white(valp_hash *hash);
 void mark_hash(valp_hash *hash);
+void forward_hash(valp_hash *hash);
 
 #endif
\ No newline at end of file
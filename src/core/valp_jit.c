@@ -0,0 +1,655 @@
+// mmap() and MAP_ANONYMOUS are not part of C99.
+#define _DEFAULT_SOURCE
+
+#include "../include/valp.h"
+
+#ifdef JIT
+
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "valp_jit.h"
+#include "valp_memory.h"
+#include "valp_vm.h"
+
+// A baseline compiler from bytecode to x86-64. Every instruction becomes
+// either a short inline sequence (stack shuffling, globals, jumps, number
+// arithmetic) or a call to one of the jit_* helpers in valp_vm.c, so the
+// generated code has no dispatch left but shares all slow paths with the
+// interpreter.
+//
+// Register use inside generated code:
+//   rbx  index of the frame being run
+//   r15  rbx * sizeof(valp_call_frame)
+//   r12  stack top, written back to vm.stack_top around helper calls
+//   r13  frame slots, reloaded after anything that can move the stack
+
+enum {
+  RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+  R12 = 12, R13 = 13, R15 = 15,
+};
+
+enum {
+  CC_E = 0x4,
+  CC_NE = 0x5,
+  CC_BE = 0x6,
+  CC_A = 0x7,
+};
+
+#define VALUE_SIZE ((int)sizeof(valp_value))
+#define PAYLOAD ((int)offsetof(valp_value, as))
+
+typedef struct {
+  int at;      // Offset of the rel32 to patch.
+  int target;  // Bytecode offset jumped to, or one of the exit labels.
+} valp_jit_fixup;
+
+#define EXIT_ERROR -1
+#define EXIT_OK -2
+
+typedef struct {
+  uint8_t *code;
+  int count;
+  int capacity;
+
+  // Native offset of each bytecode offset that starts an instruction.
+  int *labels;
+  int label_count;
+
+  valp_jit_fixup *fixups;
+  int fixup_count;
+  int fixup_capacity;
+} valp_jit;
+
+static void emit(valp_jit *jit, uint8_t byte) {
+  if (jit->capacity < jit->count + 1) {
+    int old_capacity = jit->capacity;
+    jit->capacity = GROW_CAPACITY(old_capacity);
+    jit->code = GROW_ARRAY(uint8_t, jit->code, old_capacity, jit->capacity);
+  }
+
+  jit->code[jit->count++] = byte;
+}
+
+static void emit32(valp_jit *jit, uint32_t value) {
+  for (int i = 0; i < 4; i++) emit(jit, (value >> (8 * i)) & 0xff);
+}
+
+static void emit64(valp_jit *jit, uint64_t value) {
+  for (int i = 0; i < 8; i++) emit(jit, (value >> (8 * i)) & 0xff);
+}
+
+static void patch32(valp_jit *jit, int at, int32_t value) {
+  for (int i = 0; i < 4; i++) jit->code[at + i] = ((uint32_t)value >> (8 * i)) & 0xff;
+}
+
+static void add_fixup(valp_jit *jit, int at, int target) {
+  if (jit->fixup_capacity < jit->fixup_count + 1) {
+    int old_capacity = jit->fixup_capacity;
+    jit->fixup_capacity = GROW_CAPACITY(old_capacity);
+    jit->fixups = GROW_ARRAY(valp_jit_fixup, jit->fixups, old_capacity, jit->fixup_capacity);
+  }
+
+  jit->fixups[jit->fixup_count].at = at;
+  jit->fixups[jit->fixup_count].target = target;
+  jit->fixup_count++;
+}
+
+static void rex(valp_jit *jit, bool wide, int reg, int base) {
+  uint8_t prefix = 0x40 | (wide << 3) | ((reg >> 3) << 2) | (base >> 3);
+  if (prefix != 0x40) emit(jit, prefix);
+}
+
+// ModRM for [base + disp32], with the SIB byte rsp and r12 need.
+static void mem(valp_jit *jit, int reg, int base, int32_t disp) {
+  emit(jit, 0x80 | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) emit(jit, 0x24);
+  emit32(jit, (uint32_t)disp);
+}
+
+static void load64(valp_jit *jit, int reg, int base, int32_t disp) {
+  rex(jit, true, reg, base);
+  emit(jit, 0x8b);
+  mem(jit, reg, base, disp);
+}
+
+static void store64(valp_jit *jit, int base, int32_t disp, int reg) {
+  rex(jit, true, reg, base);
+  emit(jit, 0x89);
+  mem(jit, reg, base, disp);
+}
+
+static void load32(valp_jit *jit, int reg, int base, int32_t disp) {
+  rex(jit, false, reg, base);
+  emit(jit, 0x8b);
+  mem(jit, reg, base, disp);
+}
+
+static void store32_imm(valp_jit *jit, int base, int32_t disp, int32_t value) {
+  rex(jit, false, 0, base);
+  emit(jit, 0xc7);
+  mem(jit, 0, base, disp);
+  emit32(jit, (uint32_t)value);
+}
+
+static void store64_imm(valp_jit *jit, int base, int32_t disp, int32_t value) {
+  rex(jit, true, 0, base);
+  emit(jit, 0xc7);
+  mem(jit, 0, base, disp);
+  emit32(jit, (uint32_t)value);
+}
+
+static void cmp32_imm(valp_jit *jit, int base, int32_t disp, int8_t value) {
+  rex(jit, false, 0, base);
+  emit(jit, 0x83);
+  mem(jit, 7, base, disp);
+  emit(jit, (uint8_t)value);
+}
+
+static void cmp8_imm(valp_jit *jit, int base, int32_t disp, int8_t value) {
+  rex(jit, false, 0, base);
+  emit(jit, 0x80);
+  mem(jit, 7, base, disp);
+  emit(jit, (uint8_t)value);
+}
+
+// SSE move or arithmetic between xmm0 and memory, prefix selects the form.
+static void sse(valp_jit *jit, uint8_t prefix, uint8_t opcode, int base, int32_t disp) {
+  emit(jit, prefix);
+  rex(jit, false, 0, base);
+  emit(jit, 0x0f);
+  emit(jit, opcode);
+  mem(jit, 0, base, disp);
+}
+
+static void load_value(valp_jit *jit, int base, int32_t disp) {
+  rex(jit, false, 0, base);
+  emit(jit, 0x0f);
+  emit(jit, 0x10);
+  mem(jit, 0, base, disp);
+}
+
+static void store_value(valp_jit *jit, int base, int32_t disp) {
+  rex(jit, false, 0, base);
+  emit(jit, 0x0f);
+  emit(jit, 0x11);
+  mem(jit, 0, base, disp);
+}
+
+static void mov_imm64(valp_jit *jit, int reg, uint64_t value) {
+  rex(jit, true, 0, reg);
+  emit(jit, 0xb8 + (reg & 7));
+  emit64(jit, value);
+}
+
+static void mov_imm32(valp_jit *jit, int reg, uint32_t value) {
+  rex(jit, false, 0, reg);
+  emit(jit, 0xb8 + (reg & 7));
+  emit32(jit, value);
+}
+
+static void adjust_stack(valp_jit *jit, int values) {
+  if (values == 0) return;
+
+  rex(jit, true, 0, R12);
+  emit(jit, 0x81);
+  emit(jit, 0xc0 | ((values > 0 ? 0 : 5) << 3) | (R12 & 7));
+  emit32(jit, (uint32_t)(VALUE_SIZE * (values > 0 ? values : -values)));
+}
+
+// Emits a rel32 jump and returns the offset of its operand.
+static int jump(valp_jit *jit) {
+  emit(jit, 0xe9);
+  emit32(jit, 0);
+  return jit->count - 4;
+}
+
+static int jump_if(valp_jit *jit, uint8_t cc) {
+  emit(jit, 0x0f);
+  emit(jit, 0x80 | cc);
+  emit32(jit, 0);
+  return jit->count - 4;
+}
+
+static void land(valp_jit *jit, int at) {
+  patch32(jit, at, jit->count - (at + 4));
+}
+
+static void jump_to(valp_jit *jit, int target) {
+  add_fixup(jit, jump(jit), target);
+}
+
+static void jump_to_if(valp_jit *jit, uint8_t cc, int target) {
+  add_fixup(jit, jump_if(jit, cc), target);
+}
+
+static void sync_stack_top(valp_jit *jit) {
+  mov_imm64(jit, RAX, (uint64_t)(uintptr_t)&vm.stack_top);
+  store64(jit, RAX, 0, R12);
+}
+
+// Reloads r12 and, when the stack may have moved, r13. Leaves eax alone.
+static void reload(valp_jit *jit, bool slots) {
+  mov_imm64(jit, RCX, (uint64_t)(uintptr_t)&vm.stack_top);
+  load64(jit, R12, RCX, 0);
+
+  if (slots) {
+    mov_imm64(jit, RCX, (uint64_t)(uintptr_t)&vm.frames);
+    load64(jit, RCX, RCX, 0);
+    // add rcx, r15
+    emit(jit, 0x4c);
+    emit(jit, 0x01);
+    emit(jit, 0xf9);
+    load64(jit, R13, RCX, (int32_t)offsetof(valp_call_frame, slots));
+  }
+}
+
+typedef int (*valp_jit_helper)(int frame, uint8_t *ip, int a, int b);
+
+// Calls helper(frame, ip, a, b) and leaves its result in eax. ip is the
+// next instruction, as the interpreter would have it.
+static void call_helper(valp_jit *jit, valp_jit_helper helper, uint8_t *ip, int a, int b, bool moves_stack) {
+  sync_stack_top(jit);
+
+  // mov edi, ebx
+  emit(jit, 0x89);
+  emit(jit, 0xdf);
+  mov_imm64(jit, RSI, (uint64_t)(uintptr_t)ip);
+  mov_imm32(jit, RDX, (uint32_t)a);
+  mov_imm32(jit, RCX, (uint32_t)b);
+  mov_imm64(jit, RAX, (uint64_t)(uintptr_t)helper);
+  // call rax
+  emit(jit, 0xff);
+  emit(jit, 0xd0);
+
+  reload(jit, moves_stack);
+}
+
+static void test_result(valp_jit *jit) {
+  // test eax, eax
+  emit(jit, 0x85);
+  emit(jit, 0xc0);
+}
+
+// Calls a helper and leaves the function when it reports an error.
+static void helper(valp_jit *jit, valp_jit_helper helper, uint8_t *ip, int a, int b, bool moves_stack) {
+  call_helper(jit, helper, ip, a, b, moves_stack);
+  test_result(jit);
+  jump_to_if(jit, CC_NE, EXIT_ERROR);
+}
+
+// Pushes nil, true or false.
+static void push_immediate(valp_jit *jit, valp_value value) {
+  store32_imm(jit, R12, 0, value.type);
+  store64_imm(jit, R12, PAYLOAD, IS_BOOL(value) ? AS_BOOL(value) : 0);
+  adjust_stack(jit, 1);
+}
+
+// Points rax at the global slot array.
+static void load_globals(valp_jit *jit) {
+  mov_imm64(jit, RAX, (uint64_t)(uintptr_t)&vm.globals.values);
+  load64(jit, RAX, RAX, 0);
+}
+
+static void check_global(valp_jit *jit, uint8_t *ip, int slot) {
+  cmp32_imm(jit, RAX, slot * VALUE_SIZE, VAL_UNDEFINED);
+  int defined = jump_if(jit, CC_NE);
+  call_helper(jit, jit_undefined_global, ip, slot, 0, false);
+  jump_to(jit, EXIT_ERROR);
+  land(jit, defined);
+  // The helper path clobbered rax, the defined path still has it.
+}
+
+// Number fast path for arithmetic and comparisons, with the generic helper
+// as the fallback for other operand types and errors.
+static void binary(valp_jit *jit, uint8_t *ip, uint8_t op) {
+  const int a = -2 * VALUE_SIZE + PAYLOAD;
+  const int b = -VALUE_SIZE + PAYLOAD;
+
+  cmp32_imm(jit, R12, -VALUE_SIZE, VAL_NUMBER);
+  int slow_b = jump_if(jit, CC_NE);
+  cmp32_imm(jit, R12, -2 * VALUE_SIZE, VAL_NUMBER);
+  int slow_a = jump_if(jit, CC_NE);
+
+  switch (op) {
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE: {
+      uint8_t opcode = op == OP_ADD ? 0x58 : op == OP_SUBTRACT ? 0x5c : op == OP_MULTIPLY ? 0x59 : 0x5e;
+      sse(jit, 0xf2, 0x10, R12, a);
+      sse(jit, 0xf2, opcode, R12, b);
+      sse(jit, 0xf2, 0x11, R12, a);
+      break;
+    }
+    default: {
+      // a > b and !(a > b) compare a with b, a < b and !(a < b) compare b
+      // with a. seta is false and setbe true for NaN, like the interpreter.
+      bool swap = op == OP_LESS || op == OP_GREATER_EQUAL;
+      bool negate = op == OP_GREATER_EQUAL || op == OP_LESS_EQUAL;
+      sse(jit, 0xf2, 0x10, R12, swap ? b : a);
+      sse(jit, 0x66, 0x2e, R12, swap ? a : b);
+      // setcc al; movzx eax, al
+      emit(jit, 0x0f);
+      emit(jit, 0x90 | (negate ? CC_BE : CC_A));
+      emit(jit, 0xc0);
+      emit(jit, 0x0f);
+      emit(jit, 0xb6);
+      emit(jit, 0xc0);
+      store32_imm(jit, R12, -2 * VALUE_SIZE, VAL_BOOL);
+      store64(jit, R12, a, RAX);
+      break;
+    }
+  }
+  adjust_stack(jit, -1);
+  int done = jump(jit);
+
+  land(jit, slow_b);
+  land(jit, slow_a);
+  helper(jit, jit_binary, ip, op, 0, false);
+  land(jit, done);
+}
+
+// Maps quickened instructions back to the generic form they stand for.
+static uint8_t generic_op(uint8_t op) {
+  switch (op) {
+    case OP_ADD_NUM:
+    case OP_ADD_STR:           return OP_ADD;
+    case OP_SUBTRACT_NUM:      return OP_SUBTRACT;
+    case OP_MULTIPLY_NUM:      return OP_MULTIPLY;
+    case OP_DIVIDE_NUM:        return OP_DIVIDE;
+    case OP_GREATER_NUM:       return OP_GREATER;
+    case OP_LESS_NUM:          return OP_LESS;
+    case OP_GREATER_EQUAL_NUM: return OP_GREATER_EQUAL;
+    case OP_LESS_EQUAL_NUM:    return OP_LESS_EQUAL;
+    default:                   return op;
+  }
+}
+
+static void prologue(valp_jit *jit) {
+  // push rbx; push r12; push r13; push r15; sub rsp, 8
+  emit(jit, 0x53);
+  emit(jit, 0x41); emit(jit, 0x54);
+  emit(jit, 0x41); emit(jit, 0x55);
+  emit(jit, 0x41); emit(jit, 0x57);
+  emit(jit, 0x48); emit(jit, 0x83); emit(jit, 0xec); emit(jit, 0x08);
+
+  // mov ebx, edi; imul r15, rbx, sizeof(valp_call_frame)
+  emit(jit, 0x89); emit(jit, 0xfb);
+  emit(jit, 0x4c); emit(jit, 0x69); emit(jit, 0xfb);
+  emit32(jit, (uint32_t)sizeof(valp_call_frame));
+
+  reload(jit, true);
+}
+
+// Emits the two exits and returns the offsets of the error and ok labels.
+static void epilogue(valp_jit *jit, int *error, int *ok) {
+  *error = jit->count;
+  mov_imm32(jit, RAX, 1);
+  int skip = jump(jit);
+
+  *ok = jit->count;
+  // xor eax, eax
+  emit(jit, 0x31); emit(jit, 0xc0);
+  land(jit, skip);
+
+  // add rsp, 8; pop r15; pop r13; pop r12; pop rbx; ret
+  emit(jit, 0x48); emit(jit, 0x83); emit(jit, 0xc4); emit(jit, 0x08);
+  emit(jit, 0x41); emit(jit, 0x5f);
+  emit(jit, 0x41); emit(jit, 0x5d);
+  emit(jit, 0x41); emit(jit, 0x5c);
+  emit(jit, 0x5b);
+  emit(jit, 0xc3);
+}
+
+// Translates one instruction. Returns its length in bytes, or 0 if the JIT
+// does not handle it.
+static int translate(valp_jit *jit, valp_function *function, int offset) {
+  valp_bytecode *bytecode = &function->bytecode;
+  uint8_t *code = bytecode->code + offset;
+  uint8_t op = generic_op(code[0]);
+
+#define SHORT_AT(i) ((uint16_t)((code[i] << 8) | code[i + 1]))
+
+  switch (op) {
+    case OP_CONSTANT:
+      mov_imm64(jit, RAX, (uint64_t)(uintptr_t)&bytecode->constants.values[code[1]]);
+      load_value(jit, RAX, 0);
+      store_value(jit, R12, 0);
+      adjust_stack(jit, 1);
+      return 2;
+    case OP_NIL:   push_immediate(jit, NIL_VAL); return 1;
+    case OP_TRUE:  push_immediate(jit, BOOL_VAL(true)); return 1;
+    case OP_FALSE: push_immediate(jit, BOOL_VAL(false)); return 1;
+    case OP_POP:   adjust_stack(jit, -1); return 1;
+    case OP_DUP:
+      load_value(jit, R12, -VALUE_SIZE);
+      store_value(jit, R12, 0);
+      adjust_stack(jit, 1);
+      return 1;
+    case OP_BREAK:
+      return 1;
+    case OP_GET_LOCAL:
+      load_value(jit, R13, code[1] * VALUE_SIZE);
+      store_value(jit, R12, 0);
+      adjust_stack(jit, 1);
+      return 2;
+    case OP_SET_LOCAL:
+      load_value(jit, R12, -VALUE_SIZE);
+      store_value(jit, R13, code[1] * VALUE_SIZE);
+      return 2;
+    case OP_GET_GLOBAL_SLOT: {
+      int slot = SHORT_AT(1);
+      load_globals(jit);
+      check_global(jit, code + 3, slot);
+      load_value(jit, RAX, slot * VALUE_SIZE);
+      store_value(jit, R12, 0);
+      adjust_stack(jit, 1);
+      return 3;
+    }
+    case OP_SET_GLOBAL_SLOT: {
+      int slot = SHORT_AT(1);
+      load_globals(jit);
+      check_global(jit, code + 3, slot);
+      load_value(jit, R12, -VALUE_SIZE);
+      store_value(jit, RAX, slot * VALUE_SIZE);
+      return 3;
+    }
+    case OP_DEFINE_GLOBAL_SLOT: {
+      int slot = SHORT_AT(1);
+      load_globals(jit);
+      load_value(jit, R12, -VALUE_SIZE);
+      store_value(jit, RAX, slot * VALUE_SIZE);
+      adjust_stack(jit, -1);
+      return 3;
+    }
+    case OP_GET_UPVALUE: helper(jit, jit_get_upvalue, code + 2, code[1], 0, false); return 2;
+    case OP_SET_UPVALUE: helper(jit, jit_set_upvalue, code + 2, code[1], 0, false); return 2;
+    case OP_GET_PROPERTY:
+      helper(jit, jit_get_property, code + 4, code[1], SHORT_AT(2), false);
+      return 4;
+    case OP_GET_PROPERTY_NO_POP:
+      helper(jit, jit_get_property_no_pop, code + 4, code[1], SHORT_AT(2), false);
+      return 4;
+    case OP_SET_PROPERTY:
+      helper(jit, jit_set_property, code + 4, code[1], SHORT_AT(2), false);
+      return 4;
+    case OP_GET_SUPER: helper(jit, jit_get_super, code + 2, code[1], 0, false); return 2;
+    case OP_EQUAL:     helper(jit, jit_equal, code + 1, 0, 0, false); return 1;
+    case OP_NOT_EQUAL: helper(jit, jit_equal, code + 1, 1, 0, false); return 1;
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_GREATER_EQUAL:
+    case OP_LESS_EQUAL:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+      binary(jit, code + 1, op);
+      return 1;
+    case OP_NOT:    helper(jit, jit_not, code + 1, 0, 0, false); return 1;
+    case OP_NEGATE: helper(jit, jit_negate, code + 1, 0, 0, false); return 1;
+    case OP_PRINT:  helper(jit, jit_print, code + 1, 0, 0, false); return 1;
+    case OP_JUMP:
+      jump_to(jit, offset + 3 + SHORT_AT(1));
+      return 3;
+    case OP_LOOP: {
+      mov_imm64(jit, RAX, (uint64_t)(uintptr_t)&vm.heap_exhausted);
+      cmp8_imm(jit, RAX, 0, 0);
+      int fine = jump_if(jit, CC_E);
+      helper(jit, jit_heap_exhausted, code + 3, 0, 0, false);
+      land(jit, fine);
+      jump_to(jit, offset + 3 - SHORT_AT(1));
+      return 3;
+    }
+    case OP_JUMP_IF_FALSE: {
+      int target = offset + 3 + SHORT_AT(1);
+      load32(jit, RAX, R12, -VALUE_SIZE);
+      // cmp eax, VAL_NIL
+      emit(jit, 0x83); emit(jit, 0xf8); emit(jit, VAL_NIL);
+      jump_to_if(jit, CC_E, target);
+      // cmp eax, VAL_BOOL
+      emit(jit, 0x83); emit(jit, 0xf8); emit(jit, VAL_BOOL);
+      int truthy = jump_if(jit, CC_NE);
+      cmp8_imm(jit, R12, -VALUE_SIZE + PAYLOAD, 0);
+      jump_to_if(jit, CC_E, target);
+      land(jit, truthy);
+      return 3;
+    }
+    case OP_JUMP_COMPARE:
+      call_helper(jit, jit_jump_compare, code + 3, 0, 0, false);
+      test_result(jit);
+      jump_to_if(jit, CC_NE, offset + 3 + SHORT_AT(1));
+      return 3;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+      // Tail calls keep their frame here, the OP_RETURN after them pops it.
+      helper(jit, jit_call, code + 2, code[1], 0, true);
+      return 2;
+    case OP_INVOKE:
+      helper(jit, jit_invoke, code + 5, code[1] | (code[2] << 8), SHORT_AT(3), true);
+      return 5;
+    case OP_SUPER_INVOKE:
+      helper(jit, jit_super_invoke, code + 3, code[1], code[2], true);
+      return 3;
+    case OP_CLOSURE: {
+      valp_function *closed = AS_FUNCTION(bytecode->constants.values[code[1]]);
+      int length = 2 + 2 * closed->upvalue_count;
+      helper(jit, jit_closure, code + length, code[1], 0, false);
+      return length;
+    }
+    case OP_CLOSE_UPVALUE: helper(jit, jit_close_upvalue, code + 1, 0, 0, false); return 1;
+    case OP_RETURN:
+      call_helper(jit, jit_return, code + 1, 0, 0, false);
+      jump_to(jit, EXIT_OK);
+      return 1;
+    case OP_NEW_ARRAY: helper(jit, jit_new_array, code + 2, code[1], 0, false); return 2;
+    case OP_SLICE:     helper(jit, jit_slice, code + 1, 0, 0, false); return 1;
+    default:
+      // Class definitions stay in the interpreter.
+      return 0;
+  }
+
+#undef SHORT_AT
+}
+
+static bool install(valp_function *function, valp_jit *jit) {
+  size_t page = 4096;
+  size_t size = ((size_t)jit->count + page - 1) / page * page;
+
+  void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) return false;
+
+  memcpy(memory, jit->code, jit->count);
+  if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(memory, size);
+    return false;
+  }
+
+  function->jit_code = memory;
+  function->jit_size = size;
+  return true;
+}
+
+static bool compile(valp_function *function) {
+  valp_bytecode *bytecode = &function->bytecode;
+
+  valp_jit jit;
+  jit.code = NULL;
+  jit.count = 0;
+  jit.capacity = 0;
+  jit.fixups = NULL;
+  jit.fixup_count = 0;
+  jit.fixup_capacity = 0;
+  jit.label_count = bytecode->count + 1;
+  jit.labels = ALLOCATE(int, jit.label_count);
+  for (int i = 0; i < jit.label_count; i++) jit.labels[i] = -1;
+
+  bool ok = true;
+  prologue(&jit);
+
+  for (int offset = 0; offset < bytecode->count;) {
+    jit.labels[offset] = jit.count;
+
+    int length = translate(&jit, function, offset);
+    if (length == 0) {
+      ok = false;
+      break;
+    }
+    offset += length;
+  }
+
+  if (ok) {
+    int error, exit;
+    epilogue(&jit, &error, &exit);
+
+    for (int i = 0; i < jit.fixup_count && ok; i++) {
+      valp_jit_fixup *fixup = &jit.fixups[i];
+      int target;
+
+      if (fixup->target == EXIT_ERROR) {
+        target = error;
+      } else if (fixup->target == EXIT_OK) {
+        target = exit;
+      } else if (fixup->target >= 0 && fixup->target < jit.label_count && jit.labels[fixup->target] != -1) {
+        target = jit.labels[fixup->target];
+      } else {
+        ok = false;
+        break;
+      }
+
+      patch32(&jit, fixup->at, target - (fixup->at + 4));
+    }
+  }
+
+  if (ok) ok = install(function, &jit);
+
+  FREE_ARRAY(uint8_t, jit.code, jit.capacity);
+  FREE_ARRAY(valp_jit_fixup, jit.fixups, jit.fixup_capacity);
+  FREE_ARRAY(int, jit.labels, jit.label_count);
+  return ok;
+}
+
+bool jit_prepare(valp_function *function) {
+  if (function->jit_code != NULL) return true;
+  if (function->jit_failed) return false;
+  if (++function->call_count < JIT_THRESHOLD) return false;
+
+  if (!compile(function)) {
+    function->jit_failed = true;
+    return false;
+  }
+
+  return true;
+}
+
+void jit_free(valp_function *function) {
+  if (function->jit_code == NULL) return;
+
+  munmap(function->jit_code, function->jit_size);
+  function->jit_code = NULL;
+  function->jit_size = 0;
+}
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef valp_jit_h
+#define valp_jit_h
+
+#include "../include/valp.h"
+#include "valp_object.h"
+
+#ifdef JIT
+
+#if !defined(__x86_64__) || defined(NAN_BOXING)
+#error "JIT needs an x86-64 target and the tagged value representation."
+#endif
+
+// Calls a function takes before it gets compiled.
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 1000
+#endif
+
+// Compiled code runs on the C stack, calls out of it nest. Past this many
+// compiled activations calls stay in the interpreter.
+#ifndef JIT_DEPTH_MAX
+#define JIT_DEPTH_MAX 128
+#endif
+
+// Runs the frame at the given index until it returns. Returns 0, or 1 after
+// a runtime error.
+typedef int (*valp_jit_fn)(int frame);
+
+bool jit_prepare(valp_function *function);
+void jit_free(valp_function *function);
+
+// Runtime entry points for compiled code, defined in valp_vm.c. They all
+// take the frame index and the ip of the next instruction, which is stored
+// in the frame so errors and calls see an up to date ip. The stack is
+// vm.stack_top. They return 0 to continue and 1 after a runtime error,
+// except jit_jump_compare, which returns 1 when the jump is taken.
+int jit_binary(int frame, uint8_t *ip, int op, int unused);
+int jit_equal(int frame, uint8_t *ip, int negate, int unused);
+int jit_not(int frame, uint8_t *ip, int unused, int unused2);
+int jit_negate(int frame, uint8_t *ip, int unused, int unused2);
+int jit_print(int frame, uint8_t *ip, int unused, int unused2);
+int jit_undefined_global(int frame, uint8_t *ip, int slot, int unused);
+int jit_get_upvalue(int frame, uint8_t *ip, int slot, int unused);
+int jit_set_upvalue(int frame, uint8_t *ip, int slot, int unused);
+int jit_get_property(int frame, uint8_t *ip, int constant, int cache);
+int jit_get_property_no_pop(int frame, uint8_t *ip, int constant, int cache);
+int jit_set_property(int frame, uint8_t *ip, int constant, int cache);
+int jit_get_super(int frame, uint8_t *ip, int constant, int unused);
+int jit_jump_compare(int frame, uint8_t *ip, int unused, int unused2);
+int jit_call(int frame, uint8_t *ip, int arg_count, int unused);
+int jit_invoke(int frame, uint8_t *ip, int constant_and_args, int cache);
+int jit_super_invoke(int frame, uint8_t *ip, int constant, int arg_count);
+int jit_closure(int frame, uint8_t *ip, int constant, int unused);
+int jit_close_upvalue(int frame, uint8_t *ip, int unused, int unused2);
+int jit_return(int frame, uint8_t *ip, int unused, int unused2);
+int jit_new_array(int frame, uint8_t *ip, int size, int unused);
+int jit_slice(int frame, uint8_t *ip, int unused, int unused2);
+int jit_heap_exhausted(int frame, uint8_t *ip, int unused, int unused2);
+
+#endif
+
+#endif
@@ -1,28 +1,188 @@
+// For mmap and madvise.
+#define _DEFAULT_SOURCE
+
+#include <ctype.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 #include "valp_compiler.h"
 #include "valp_memory.h"
 #include "valp_vm.h"
 
+#ifdef JIT
+#include "valp_jit.h"
+#endif
+
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
 #include "valp_debug.h"
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+#if defined(PARALLEL_MARK) || defined(CONCURRENT_SWEEP)
+#include <pthread.h>
+#endif
+
+// Keeps freed slab slots poisoned, so sanitized builds still catch an
+// object used after the collector freed it. Those builds also use up the
+// fresh slots of a page first, so a freed slot stays poisoned a while
+// instead of coming straight back.
+#if defined(__SANITIZE_ADDRESS__)
+#include <sanitizer/asan_interface.h>
+#define POISON_SLOT(slot, size) ASAN_POISON_MEMORY_REGION(slot, size)
+#define UNPOISON_SLOT(slot, size) ASAN_UNPOISON_MEMORY_REGION(slot, size)
+#define SLAB_FRESH_FIRST true
+#else
+#define SLAB_FRESH_FIRST false
+#define POISON_SLOT(slot, size) ((void)(slot), (void)(size))
+#define UNPOISON_SLOT(slot, size) ((void)(slot), (void)(size))
+#endif
 
-void *reallocate(void *pointer, size_t old_size, size_t new_size) {
-  vm.bytes_allocated += new_size - old_size;
+// Under DEBUG_STRESS_GC every allocation collects the nursery and every
+// GC_STRESS_FULL-th one starts a major collection.
+#define GC_STRESS_FULL 8
 
-  if (new_size > old_size) {
+// With vm.gc.compact set, a major collection asks for compaction once it
+// would empty this many pages, or any page under DEBUG_STRESS_GC.
 #ifdef DEBUG_STRESS_GC
-  collect_garbage();
+#define COMPACT_MIN_PAGES 1
+#else
+#define COMPACT_MIN_PAGES 16
 #endif
 
-    if (vm.bytes_allocated > vm.next_gc) {
-      collect_garbage();
-    }
+static void start_major();
+static void gc_step();
+static void gc_slice(int budget);
+static int evacuable_pages();
+
+#ifdef CONCURRENT_SWEEP
+// Pages the last major collection handed to the background sweeper. The
+// sweeper frees their dead objects in order and counts the pages it is
+// done with in swept. The mutator alone moves pages between lists, so it
+// settles swept pages itself, and credits freed_bytes, what the buffers of
+// the dead objects took.
+static struct {
+  pthread_t thread;
+  bool running;
+  struct valp_slab_page **pages;
+  int count;
+  int capacity;
+  int swept;
+  int settled;
+  size_t freed_bytes;
+} sweeper;
+
+// Set on the sweeper thread, where reallocate() only ever frees.
+static __thread bool is_sweeper = false;
+
+#define SWEEPING_IN_BACKGROUND sweeper.running
+#else
+#define SWEEPING_IN_BACKGROUND false
+#endif
+
+#ifdef CONCURRENT_SWEEP
+// The sweeper thread frees objects as well.
+#define COUNT_FREED(counter, amount) __atomic_add_fetch(&(counter), amount, __ATOMIC_RELAXED)
+#define READ_FREED(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+#else
+#define COUNT_FREED(counter, amount) ((counter) += (amount))
+#define READ_FREED(counter) (counter)
+#endif
+
+// Collections nest, a major one started by collect_garbage() runs slices
+// for instance, so only the outermost one times the pause.
+static int pause_depth = 0;
+static uint64_t pause_start;
+
+static uint64_t now_ns() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+}
+
+static void begin_pause() {
+  if (pause_depth++ == 0) pause_start = now_ns();
+}
+
+static void end_pause() {
+  if (--pause_depth > 0) return;
+
+  uint64_t pause = now_ns() - pause_start;
+  valp_gc_stats *stats = &vm.gc_stats;
+  stats->pause_total_ns += pause;
+  if (pause > stats->pause_max_ns) stats->pause_max_ns = pause;
+
+  int bucket = 0;
+  for (uint64_t us = pause / 1000; us > 0 && bucket < GC_PAUSE_BUCKETS - 1; us >>= 1) {
+    bucket++;
+  }
+  stats->pauses[bucket]++;
+}
+
+void out_of_memory() {
+  fprintf(stderr, "Out of memory.\n");
+  exit(1);
+}
+
+// Runs what the collector owes before size more bytes get allocated.
+static void collect_if_needed(size_t size) {
+  vm.young_bytes += size;
+
+  // Past the hard cap only a full collection can help. If it does not, the
+  // allocation still goes through and the interpreter stops the script.
+  if (vm.gc.heap_limit > 0 && !vm.heap_exhausted &&
+      vm.bytes_allocated + size > vm.gc.heap_limit) {
+    collect_garbage();
+    vm.heap_exhausted = vm.bytes_allocated + size > vm.gc.heap_limit;
+    return;
+  }
+
+  // Minor collections wait while a major one is under way, the slices of
+  // the major one stand in for them.
+  if (vm.gc_phase != GC_IDLE) {
+    gc_step();
+    return;
+  }
+
+#ifdef DEBUG_STRESS_GC
+  static int stress_count = 0;
+  if (++stress_count % GC_STRESS_FULL == 0) {
+    start_major();
+  } else {
+    collect_young();
+  }
+#endif
+
+  if (vm.gc_phase != GC_IDLE) {
+    // Started above.
+  } else if (vm.bytes_allocated > vm.next_gc) {
+    start_major();
+  } else if (vm.young_bytes > vm.gc.nursery_size) {
+    collect_young();
+  }
+}
+
+void *reallocate(void *pointer, size_t old_size, size_t new_size) {
+#ifdef CONCURRENT_SWEEP
+  if (is_sweeper) {
+    __atomic_add_fetch(&sweeper.freed_bytes, old_size, __ATOMIC_RELAXED);
+    free(pointer);
+    return NULL;
   }
+#endif
+
+  if (new_size > old_size) collect_if_needed(new_size - old_size);
+
+  vm.bytes_allocated += new_size - old_size;
 
   if (new_size == 0) {
     free(pointer);
@@ -30,84 +190,693 @@ void *reallocate(void *pointer, size_t old_size, size_t new_size) {
   }
 
   void *result = realloc(pointer, new_size);
-  if (result == NULL) exit(1);
+  if (result == NULL) {
+    collect_garbage();
+    result = realloc(pointer, new_size);
+    if (result == NULL) out_of_memory();
+  }
+  return result;
+}
+
+void *gc_allocate(size_t size) {
+  vm.bytes_allocated += size;
+
+  void *result = malloc(size);
+  if (result == NULL) out_of_memory();
   return result;
 }
 
+// Objects up to SLAB_MAX bytes live in pages of SLAB_PAGE_SIZE bytes, each
+// page cut into slots of one size class. Pages are aligned to their size so
+// a slot finds its page by masking its address. The heap is charged a whole
+// page when one gets mapped and credited when an empty one is handed back.
+//
+// A page header carries bitmaps of the slots in use, of the free ones and
+// of the mark bits of their objects, one bit per SLAB_GRANULE bytes.
+// Marking only writes those, so the pages holding the objects stay
+// untouched, and shared after a fork. Free slots keep no state of their
+// own, which lets release_memory() drop them.
+
+// Which list of its size class a page is on.
+typedef enum {
+  SLAB_AVAILABLE,  // Has a slot to spare.
+  SLAB_FULL,
+  SLAB_UNSWEPT,    // Waits for the sweep of a major collection.
+  SLAB_STATES
+} valp_slab_state;
+
+#define SLAB_BITMAP_WORDS (SLAB_PAGE_SIZE / SLAB_GRANULE / 64)
+
+typedef struct valp_slab_page {
+  struct valp_slab_page *prev;
+  struct valp_slab_page *next;
+  // Slots never handed out run from here to the end of the page.
+  uint8_t *fresh;
+  int live;
+  // Slots given back, in free_slots. None lie in words before free_hint.
+  int free_count;
+  int free_hint;
+  int size_class;
+  valp_slab_state state;
+  // Being emptied by compact_heap(). The objects left on it hold their new
+  // address in their next field.
+  bool evacuating;
+  // System pages of this page given back by release_memory(), one bit each.
+  uint64_t purged;
+  uint64_t allocated[SLAB_BITMAP_WORDS];
+  uint64_t free_slots[SLAB_BITMAP_WORDS];
+  uint64_t marks[SLAB_BITMAP_WORDS];
+} valp_slab_page;
+
+#define SLAB_HEADER \
+    ((sizeof(valp_slab_page) + SLAB_GRANULE - 1) & ~(size_t)(SLAB_GRANULE - 1))
+
+#define SLAB_PAGE_OF(slot) \
+    ((valp_slab_page*)((uintptr_t)(slot) & ~(uintptr_t)(SLAB_PAGE_SIZE - 1)))
+
+#define SLAB_CLASS_SIZE(size_class) (((size_t)(size_class) + 1) * SLAB_GRANULE)
+
+// Bit of a slot in the bitmaps of its page.
+#define SLAB_BIT(page, slot) \
+    ((size_t)((uint8_t*)(slot) - (uint8_t*)(page)) / SLAB_GRANULE)
+
+static struct {
+  valp_slab_page *pages[SLAB_STATES];
+  int page_count;
+} slab_classes[SLAB_CLASSES];
+
+// Emptied pages kept for the next class that runs out, linked through next.
+// Minor collections empty whole pages of young objects at a time, this
+// saves mapping them again right after.
+static valp_slab_page *slab_empty;
+static int slab_empty_count;
+
+static void free_object(valp_obj *object);
+
+static void slab_unlink(valp_slab_page *page) {
+  if (page->prev != NULL) {
+    page->prev->next = page->next;
+  } else {
+    slab_classes[page->size_class].pages[page->state] = page->next;
+  }
+  if (page->next != NULL) page->next->prev = page->prev;
+  page->prev = NULL;
+  page->next = NULL;
+}
+
+static void slab_link(valp_slab_page *page, valp_slab_state state) {
+  valp_slab_page **list = &slab_classes[page->size_class].pages[state];
+  page->state = state;
+  page->prev = NULL;
+  page->next = *list;
+  if (page->next != NULL) page->next->prev = page;
+  *list = page;
+}
+
+static void slab_move(valp_slab_page *page, valp_slab_state state) {
+  slab_unlink(page);
+  slab_link(page, state);
+}
+
+static bool slab_is_full(valp_slab_page *page) {
+  size_t slot_size = SLAB_CLASS_SIZE(page->size_class);
+  return page->free_count == 0 &&
+      page->fresh + slot_size > (uint8_t*)page + SLAB_PAGE_SIZE;
+}
+
+// Size of the pages of the system, which madvise() works in.
+static size_t system_page_size() {
+  static size_t size = 0;
+  if (size == 0) size = (size_t)sysconf(_SC_PAGESIZE);
+  return size;
+}
+
+// Maps a page aligned to its size by mapping twice as much and trimming.
+static valp_slab_page *map_slab_page() {
+  size_t size = SLAB_PAGE_SIZE * 2;
+  uint8_t *memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED) out_of_memory();
+
+  uint8_t *page = (uint8_t*)(((uintptr_t)memory + SLAB_PAGE_SIZE - 1) &
+                             ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+  if (page > memory) munmap(memory, page - memory);
+  if (page + SLAB_PAGE_SIZE < memory + size) {
+    munmap(page + SLAB_PAGE_SIZE, memory + size - (page + SLAB_PAGE_SIZE));
+  }
+
+  ((valp_slab_page*)page)->purged = 0;
+  return (valp_slab_page*)page;
+}
+
+static valp_slab_page *new_slab_page(int size_class) {
+  valp_slab_page *page = slab_empty;
+  if (page != NULL) {
+    slab_empty = page->next;
+    slab_empty_count--;
+  } else {
+    page = map_slab_page();
+  }
+  vm.bytes_allocated += SLAB_PAGE_SIZE;
+
+  page->fresh = (uint8_t*)page + SLAB_HEADER;
+  page->live = 0;
+  page->free_count = 0;
+  page->free_hint = 0;
+  page->size_class = size_class;
+  page->evacuating = false;
+  memset(page->allocated, 0, sizeof(page->allocated));
+  memset(page->free_slots, 0, sizeof(page->free_slots));
+  memset(page->marks, 0, sizeof(page->marks));
+  POISON_SLOT(page->fresh, SLAB_PAGE_SIZE - SLAB_HEADER);
+  slab_link(page, SLAB_AVAILABLE);
+  slab_classes[size_class].page_count++;
+  return page;
+}
+
+// Hands an empty page back, unless it is the last one of its class, so a
+// class that drains and refills does not map a page each time.
+static void release_slab_page(valp_slab_page *page) {
+  if (slab_classes[page->size_class].page_count == 1) return;
+
+  slab_unlink(page);
+  slab_classes[page->size_class].page_count--;
+  vm.bytes_allocated -= SLAB_PAGE_SIZE;
+
+  if (slab_empty_count < SLAB_EMPTY_MAX) {
+    page->next = slab_empty;
+    slab_empty = page;
+    slab_empty_count++;
+  } else {
+    munmap(page, SLAB_PAGE_SIZE);
+  }
+}
+
+// Frees the unmarked objects of an unswept page and clears its marks,
+// leaving the page where it is. Returns how many it freed.
+static int free_dead(valp_slab_page *page) {
+  int freed = 0;
+
+  for (int i = 0; i < SLAB_BITMAP_WORDS; i++) {
+    uint64_t dead = page->allocated[i] & ~page->marks[i];
+    while (dead != 0) {
+      int bit = __builtin_ctzll(dead);
+      dead &= dead - 1;
+      free_object((valp_obj*)((uint8_t*)page + ((size_t)i * 64 + bit) * SLAB_GRANULE));
+      freed++;
+    }
+    page->marks[i] = 0;
+  }
+
+  return freed;
+}
+
+// Puts a swept page back on the list of its class it belongs on.
+static void settle_page(valp_slab_page *page) {
+  if (page->live == 0) {
+    slab_move(page, SLAB_AVAILABLE);
+    release_slab_page(page);
+  } else {
+    slab_move(page, slab_is_full(page) ? SLAB_FULL : SLAB_AVAILABLE);
+  }
+}
+
+static int sweep_page(valp_slab_page *page) {
+  int freed = free_dead(page);
+  settle_page(page);
+  return freed;
+}
+
+// Queues every page for the sweep of the major collection that just
+// finished marking.
+static void unsweep_slabs() {
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    for (int state = SLAB_AVAILABLE; state <= SLAB_FULL; state++) {
+      while (slab_classes[i].pages[state] != NULL) {
+        slab_move(slab_classes[i].pages[state], SLAB_UNSWEPT);
+      }
+    }
+  }
+}
+
+static valp_slab_page *next_unswept() {
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    if (slab_classes[i].pages[SLAB_UNSWEPT] != NULL) {
+      return slab_classes[i].pages[SLAB_UNSWEPT];
+    }
+  }
+  return NULL;
+}
+
+#ifdef CONCURRENT_SWEEP
+static void *sweep_worker(void *unused) {
+  (void)unused;
+  is_sweeper = true;
+
+  for (int i = 0; i < sweeper.count; i++) {
+    free_dead(sweeper.pages[i]);
+    __atomic_store_n(&sweeper.swept, i + 1, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+// Hands the unswept pages to a new sweeper thread. They stay on the
+// unswept lists until settled, and if the thread cannot be started the
+// mutator sweeps them as usual.
+static void start_background_sweep() {
+  sweeper.count = 0;
+  sweeper.swept = 0;
+  sweeper.settled = 0;
+
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    valp_slab_page *page = slab_classes[i].pages[SLAB_UNSWEPT];
+    for (; page != NULL; page = page->next) {
+      if (sweeper.capacity < sweeper.count + 1) {
+        sweeper.capacity = GROW_CAPACITY(sweeper.capacity);
+        sweeper.pages = realloc(sweeper.pages, sizeof(valp_slab_page*) * sweeper.capacity);
+
+        if (sweeper.pages == NULL) out_of_memory();
+      }
+      sweeper.pages[sweeper.count++] = page;
+    }
+  }
+
+  if (sweeper.count == 0) return;
+  sweeper.running = pthread_create(&sweeper.thread, NULL, sweep_worker, NULL) == 0;
+}
+
+// Settles the pages the sweeper is done with, first waiting for all of
+// them if wait is set. Returns true once the sweeper has finished.
+static bool settle_swept(bool wait) {
+  if (!sweeper.running) return true;
+  if (wait) pthread_join(sweeper.thread, NULL);
+
+  int swept = __atomic_load_n(&sweeper.swept, __ATOMIC_ACQUIRE);
+  while (sweeper.settled < swept) {
+    settle_page(sweeper.pages[sweeper.settled++]);
+  }
+  vm.bytes_allocated -= __atomic_exchange_n(&sweeper.freed_bytes, 0, __ATOMIC_RELAXED);
+
+  if (sweeper.settled < sweeper.count) return false;
+
+  if (!wait) pthread_join(sweeper.thread, NULL);
+  sweeper.running = false;
+  return true;
+}
+#endif
+
+// Takes the free slot with the lowest address, which packs objects at the
+// start of their pages and leaves the ends empty for release_memory().
+static void *take_free_slot(valp_slab_page *page) {
+  int i = page->free_hint;
+  while (page->free_slots[i] == 0) i++;
+
+  int bit = __builtin_ctzll(page->free_slots[i]);
+  page->free_slots[i] &= page->free_slots[i] - 1;
+  page->free_hint = i;
+  page->free_count--;
+  return (uint8_t*)page + ((size_t)i * 64 + bit) * SLAB_GRANULE;
+}
+
+// Hands out a slot of a size class without collecting.
+static void *slab_take(int size_class) {
+  size_t slot_size = SLAB_CLASS_SIZE(size_class);
+
+  // Sweep lazily: before a class maps a new page it sweeps its own pages
+  // the running major collection has not got to yet, unless they belong to
+  // the background sweeper.
+  valp_slab_page **pages = slab_classes[size_class].pages;
+  while (pages[SLAB_AVAILABLE] == NULL && pages[SLAB_UNSWEPT] != NULL &&
+         !SWEEPING_IN_BACKGROUND) {
+    sweep_page(pages[SLAB_UNSWEPT]);
+  }
+
+  valp_slab_page *page = pages[SLAB_AVAILABLE];
+  if (page == NULL) page = new_slab_page(size_class);
+
+  void *slot;
+  if (page->free_count > 0 && !SLAB_FRESH_FIRST) {
+    slot = take_free_slot(page);
+  } else if (page->fresh + slot_size <= (uint8_t*)page + SLAB_PAGE_SIZE) {
+    slot = page->fresh;
+    page->fresh += slot_size;
+  } else {
+    slot = take_free_slot(page);
+  }
+  UNPOISON_SLOT(slot, slot_size);
+  page->live++;
+
+  size_t bit = SLAB_BIT(page, slot);
+  page->allocated[bit / 64] |= (uint64_t)1 << (bit % 64);
+
+  if (page->purged != 0) {
+    size_t first = ((uint8_t*)slot - (uint8_t*)page) / system_page_size();
+    size_t last = ((uint8_t*)slot + slot_size - 1 - (uint8_t*)page) / system_page_size();
+    for (size_t i = first; i <= last; i++) page->purged &= ~((uint64_t)1 << i);
+  }
+
+  if (slab_is_full(page)) slab_move(page, SLAB_FULL);
+  return slot;
+}
+
+void *slab_allocate(size_t size) {
+  if (size > SLAB_MAX) return reallocate(NULL, 0, size);
+
+  int size_class = (int)((size - 1) / SLAB_GRANULE);
+  // Collect first, whatever it frees can serve this allocation.
+  collect_if_needed(SLAB_CLASS_SIZE(size_class));
+  return slab_take(size_class);
+}
+
+void slab_free(void *pointer, size_t size) {
+  if (size > SLAB_MAX) {
+    reallocate(pointer, size, 0);
+    return;
+  }
+
+  valp_slab_page *page = SLAB_PAGE_OF(pointer);
+  size_t bit = SLAB_BIT(page, pointer);
+  page->allocated[bit / 64] &= ~((uint64_t)1 << (bit % 64));
+
+  page->free_slots[bit / 64] |= (uint64_t)1 << (bit % 64);
+  page->free_count++;
+  if ((int)(bit / 64) < page->free_hint) page->free_hint = (int)(bit / 64);
+  POISON_SLOT(pointer, SLAB_CLASS_SIZE(page->size_class));
+  page->live--;
+
+  // Unswept pages are settled by sweep_page().
+  if (page->state == SLAB_FULL) {
+    slab_move(page, SLAB_AVAILABLE);
+  } else if (page->state == SLAB_AVAILABLE && page->live == 0) {
+    release_slab_page(page);
+  }
+}
+
+// Frees every object still on a page, then the pages.
+static void free_slabs() {
+  unsweep_slabs();
+  for (valp_slab_page *page = next_unswept(); page != NULL; page = next_unswept()) {
+    memset(page->marks, 0, sizeof(page->marks));
+    sweep_page(page);
+  }
+
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    for (int state = 0; state < SLAB_STATES; state++) {
+      valp_slab_page *page = slab_classes[i].pages[state];
+      while (page != NULL) {
+        valp_slab_page *next = page->next;
+        vm.bytes_allocated -= SLAB_PAGE_SIZE;
+        munmap(page, SLAB_PAGE_SIZE);
+        page = next;
+      }
+      slab_classes[i].pages[state] = NULL;
+    }
+    slab_classes[i].page_count = 0;
+  }
+
+  while (slab_empty != NULL) {
+    valp_slab_page *next = slab_empty->next;
+    munmap(slab_empty, SLAB_PAGE_SIZE);
+    slab_empty = next;
+  }
+  slab_empty_count = 0;
+}
+
+// True when no bit from..to-1 of bits is set.
+static bool bits_clear(const uint64_t *bits, size_t from, size_t to) {
+  for (size_t i = from; i < to; i++) {
+    if (i % 64 == 0 && i + 64 <= to) {
+      if (bits[i / 64] != 0) return false;
+      i += 63;
+    } else if ((bits[i / 64] >> (i % 64)) & 1) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Gives the system pages of page that no object overlaps back, in runs.
+static void purge_page(valp_slab_page *page) {
+  size_t system_page = system_page_size();
+  size_t slot_size = SLAB_CLASS_SIZE(page->size_class);
+  size_t first = (SLAB_HEADER + system_page - 1) / system_page;
+  size_t count = SLAB_PAGE_SIZE / system_page;
+  size_t run = 0;
+
+  for (size_t i = first; i <= count; i++) {
+    bool empty = false;
+    if (i < count && !((page->purged >> i) & 1)) {
+      // Slots starting up to a slot before the system page reach into it.
+      size_t start = i * system_page;
+      size_t from = start >= SLAB_HEADER + slot_size ? start - slot_size + SLAB_GRANULE : SLAB_HEADER;
+      empty = bits_clear(page->allocated, from / SLAB_GRANULE,
+                         (start + system_page) / SLAB_GRANULE);
+    }
+
+    if (empty) {
+      page->purged |= (uint64_t)1 << i;
+      run++;
+    } else if (run > 0) {
+      madvise((uint8_t*)page + (i - run) * system_page, run * system_page, MADV_DONTNEED);
+      run = 0;
+    }
+  }
+}
+
+// Hands back the memory between objects. Runs after the sweep of a major
+// collection and after compact_heap() when vm.gc.release is set: drops the
+// system pages of slab pages that no object overlaps, unmaps the cached
+// empty pages and trims malloc.
+static void release_memory() {
+  if (system_page_size() < SLAB_PAGE_SIZE) {
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+      valp_slab_page *page = slab_classes[i].pages[SLAB_AVAILABLE];
+      for (; page != NULL; page = page->next) purge_page(page);
+    }
+  }
+
+  while (slab_empty != NULL) {
+    valp_slab_page *next = slab_empty->next;
+    munmap(slab_empty, SLAB_PAGE_SIZE);
+    slab_empty = next;
+  }
+  slab_empty_count = 0;
+
+#ifdef __GLIBC__
+  malloc_trim(0);
+#endif
+}
+
+// Mark bits. Large objects, which are not on a page, keep theirs in the
+// object header.
+
+static bool is_marked(valp_obj *object) {
+  if (object->is_large) return object->is_marked;
+  valp_slab_page *page = SLAB_PAGE_OF(object);
+  size_t bit = SLAB_BIT(page, object);
+  return (page->marks[bit / 64] >> (bit % 64)) & 1;
+}
+
+static void set_marked(valp_obj *object) {
+  if (object->is_large) {
+    object->is_marked = true;
+    return;
+  }
+  valp_slab_page *page = SLAB_PAGE_OF(object);
+  size_t bit = SLAB_BIT(page, object);
+  page->marks[bit / 64] |= (uint64_t)1 << (bit % 64);
+}
+
+static void clear_marked(valp_obj *object) {
+  if (object->is_large) {
+    object->is_marked = false;
+    return;
+  }
+  valp_slab_page *page = SLAB_PAGE_OF(object);
+  size_t bit = SLAB_BIT(page, object);
+  page->marks[bit / 64] &= ~((uint64_t)1 << (bit % 64));
+}
+
+// Size the object was allocated with.
+static size_t object_size(valp_obj *object) {
+  switch (object->type) {
+    case OBJ_BOUND_METHOD: return sizeof(valp_bound_method);
+    case OBJ_CLASS: return sizeof(valp_class);
+    case OBJ_CLOSURE: return sizeof(valp_obj_closure);
+    case OBJ_FUNCTION: return sizeof(valp_function);
+    case OBJ_INSTANCE:
+      return sizeof(valp_instance) +
+          sizeof(valp_value) * ((valp_instance*)object)->inline_capacity;
+    case OBJ_NATIVE: return sizeof(valp_obj_native);
+    case OBJ_STRING: return sizeof(valp_string) + ((valp_string*)object)->length + 1;
+    case OBJ_UPVALUE: return sizeof(valp_obj_upvalue);
+    case OBJ_ARRAY: return sizeof(valp_array);
+    case OBJ_SHAPE: return sizeof(valp_shape);
+    case OBJ_ROPE: return sizeof(valp_rope);
+    case OBJ_STRING_BUILDER: return sizeof(valp_string_builder);
+  }
+  return 0;
+}
+
 static void free_object(valp_obj *object) {
 #ifdef DEBUG_LOG_GC
   printf("%p free type %d\n", (void*)object, object->type);
 #endif
 
+  COUNT_FREED(vm.gc_stats.freed_bytes[object->type], object_size(object));
+  COUNT_FREED(vm.gc_stats.freed_objects[object->type], 1);
+
   switch (object->type) {
     case OBJ_BOUND_METHOD: {
-      FREE(valp_bound_method, object);
+      FREE_OBJ(valp_bound_method, object);
       break;
     }
     case OBJ_CLASS: {
       valp_class *klass = (valp_class*)object;
       free_hash(&klass->methods);
-      FREE(valp_class, object);
+      FREE_OBJ(valp_class, object);
       break;
     }
     case OBJ_CLOSURE: {
       valp_obj_closure *closure = (valp_obj_closure*)object;
       FREE_ARRAY(valp_obj_upvalue*, closure->upvalues, closure->upvalue_count);
-      FREE(valp_obj_closure, object);
+      FREE_OBJ(valp_obj_closure, object);
       break;
     }
     case OBJ_FUNCTION: {
       valp_function *function = (valp_function*)object;
+#ifdef JIT
+      jit_free(function);
+#endif
       free_bytecode(&function->bytecode);
-      FREE(valp_function, object);
+      FREE_OBJ(valp_function, object);
       break;
     }
     case OBJ_INSTANCE: {
       valp_instance *instance = (valp_instance*)object;
-      free_hash(&instance->fields);
-      FREE(valp_instance, object);
+      if (instance->slots != NULL) {
+        FREE_ARRAY(valp_value, instance->slots, instance->slot_capacity);
+      }
+      if (instance->fields != NULL) {
+        free_hash(instance->fields);
+        FREE(valp_hash, instance->fields);
+      }
+      slab_free(object, object_size(object));
       break;
     }
     case OBJ_NATIVE: {
-      FREE(valp_obj_native, object);
+      FREE_OBJ(valp_obj_native, object);
       break;
     }
     case OBJ_STRING: {
-      valp_string *string = (valp_string*)object;
-      FREE_ARRAY(char, string->chars, string->length + 1);
-      FREE(valp_string, object);
+      slab_free(object, object_size(object));
       break;
     }
     case OBJ_UPVALUE: {
-      FREE(valp_obj_upvalue, object);
+      FREE_OBJ(valp_obj_upvalue, object);
       break;
     }
     case OBJ_ARRAY: {
       valp_array *arr = (valp_array*)object;
       free_valp_value_array(&arr->values);
-      FREE(valp_array, arr);
+      FREE_OBJ(valp_array, arr);
+      break;
+    }
+    case OBJ_SHAPE: {
+      valp_shape *shape = (valp_shape*)object;
+      free_hash(&shape->slots);
+      free_hash(&shape->transitions);
+      FREE_OBJ(valp_shape, object);
+      break;
+    }
+    case OBJ_ROPE: {
+      FREE_OBJ(valp_rope, object);
+      break;
+    }
+    case OBJ_STRING_BUILDER: {
+      valp_string_builder *builder = (valp_string_builder*)object;
+      FREE_ARRAY(char, builder->chars, builder->capacity);
+      FREE_OBJ(valp_string_builder, object);
       break;
     }
   }
 }
 
+// True for objects the collection in progress has not reached. A minor
+// collection takes every old object to be alive.
+bool is_white(valp_obj *object) {
+  return !is_marked(object) && !(vm.collecting_young && object->is_old);
+}
+
+#ifdef PARALLEL_MARK
+typedef struct {
+  valp_obj **objects;
+  int count;
+  int capacity;
+} valp_mark_stack;
+
+// The gray stack of the calling thread while markers run in parallel.
+static __thread valp_mark_stack *marker = NULL;
+
+static void mark_stack_push(valp_mark_stack *stack, valp_obj *object) {
+  if (stack->capacity < stack->count + 1) {
+    stack->capacity = GROW_CAPACITY(stack->capacity);
+    stack->objects = realloc(stack->objects, sizeof(valp_obj*) * stack->capacity);
+
+    if (stack->objects == NULL) out_of_memory();
+  }
+
+  stack->objects[stack->count++] = object;
+}
+#endif
+
+#ifdef DEBUG_LOG_GC
+// Printing would flatten a rope, which cannot allocate in the middle of a
+// collection.
+static void log_object(valp_obj *object) {
+  if (object->type == OBJ_ROPE && ((valp_rope*)object)->flat == NULL) {
+    printf("rope");
+  } else {
+    print_value(OBJ_VAL(object));
+  }
+}
+#endif
+
 void mark_object(valp_obj *object) {
   if (object == NULL) return;
-  if (object->is_marked) return;
+
+#ifdef PARALLEL_MARK
+  if (marker != NULL) {
+    if (vm.collecting_young && object->is_old) return;
+    // Whoever flips the bit first traces the object.
+    if (object->is_large) {
+      if (__atomic_exchange_n(&object->is_marked, true, __ATOMIC_RELAXED)) return;
+    } else {
+      valp_slab_page *page = SLAB_PAGE_OF(object);
+      size_t bit = SLAB_BIT(page, object);
+      uint64_t mask = (uint64_t)1 << (bit % 64);
+      if (__atomic_fetch_or(&page->marks[bit / 64], mask, __ATOMIC_RELAXED) & mask) return;
+    }
+    mark_stack_push(marker, object);
+    return;
+  }
+#endif
+
+  if (!is_white(object)) return;
 
 #ifdef DEBUG_LOG_GC
   printf("%p mark ", (void*)object);
-  print_value(OBJ_VAL(object));
+  log_object(object);
   printf("\n");
 #endif
 
-  object->is_marked = true;
+  set_marked(object);
 
   if (vm.gray_capacity < vm.gray_count + 1) {
     vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
     vm.gray_stack = realloc(vm.gray_stack, sizeof(valp_obj*) * vm.gray_capacity);
 
-    if (vm.gray_stack == NULL) exit(1);
+    if (vm.gray_stack == NULL) out_of_memory();
   }
 
   vm.gray_stack[vm.gray_count++] = object;
@@ -127,7 +896,7 @@ static void mark_array(valp_value_array *array) {
 static void blacken_object(valp_obj *object) {
 #ifdef DEBUG_LOG_GC
   printf("%p blacken ", (void*)object);
-  print_value(OBJ_VAL(object));
+  log_object(object);
   printf("\n");
 #endif
 
@@ -141,6 +910,7 @@ static void blacken_object(valp_obj *object) {
     case OBJ_CLASS: {
       valp_class *klass = (valp_class*)object;
       mark_object((valp_obj*)klass->name);
+      mark_object((valp_obj*)klass->shape);
       mark_hash(&klass->methods);
       break;
     }
@@ -156,12 +926,35 @@ static void blacken_object(valp_obj *object) {
       valp_function *function = (valp_function*)object;
       mark_object((valp_obj*)function->name);
       mark_array(&function->bytecode.constants);
+      for (int i = 0; i < function->bytecode.cache_count; i++) {
+        valp_inline_cache *cache = &function->bytecode.caches[i];
+        for (int j = 0; j < cache->count; j++) {
+          mark_object((valp_obj*)cache->entries[j].shape);
+          mark_object((valp_obj*)cache->entries[j].next_shape);
+          mark_object((valp_obj*)cache->entries[j].method);
+        }
+      }
       break;
     }
     case OBJ_INSTANCE: {
       valp_instance *instance = (valp_instance*)object;
       mark_object((valp_obj*)instance->klass);
-      mark_hash(&instance->fields);
+      if (instance->shape != NULL) {
+        mark_object((valp_obj*)instance->shape);
+        valp_value *slots = instance_slots(instance);
+        for (int i = 0; i < instance->shape->slot_count; i++) {
+          mark_value(slots[i]);
+        }
+      }
+      if (instance->fields != NULL) mark_hash(instance->fields);
+      break;
+    }
+    case OBJ_SHAPE: {
+      valp_shape *shape = (valp_shape*)object;
+      mark_object((valp_obj*)shape->parent);
+      mark_object((valp_obj*)shape->name);
+      mark_hash(&shape->slots);
+      mark_hash(&shape->transitions);
       break;
     }
     case OBJ_UPVALUE: {
@@ -173,8 +966,16 @@ static void blacken_object(valp_obj *object) {
       mark_array(&arr->values);
       break;
     }
+    case OBJ_ROPE: {
+      valp_rope *rope = (valp_rope*)object;
+      mark_object(rope->left);
+      mark_object(rope->right);
+      mark_object((valp_obj*)rope->flat);
+      break;
+    }
     case OBJ_NATIVE:
     case OBJ_STRING:
+    case OBJ_STRING_BUILDER:
       break;
   }
 }
@@ -192,70 +993,899 @@ static void mark_roots() {
     mark_object((valp_obj*)upvalue);
   }
 
-  mark_hash(&vm.globals);
+  mark_hash(&vm.global_slots);
+  mark_array(&vm.globals);
+  mark_array(&vm.global_names);
+  mark_hash(&vm.array_methods);
+  mark_hash(&vm.string_methods);
+  mark_hash(&vm.string_builder_methods);
   mark_compiler_roots();
   mark_object((valp_obj*)vm.init_string);
 }
 
-static void trace_references() {
-  while (vm.gray_count > 0) {
-    valp_obj *object = vm.gray_stack[--vm.gray_count];
-    blacken_object(object);
+#ifdef PARALLEL_MARK
+// Gray objects a marker keeps to itself before it hands half of them to
+// markers that ran out of work, and the most it takes back at once.
+#define MARK_SHARE_THRESHOLD 64
+
+// Work shared between the markers, guarded by lock. Markers that find the
+// pool empty wait on wake. Marking is done when all of them wait.
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  valp_mark_stack pool;
+  int idle;
+  int threads;
+} shared;
+
+static void share_work(valp_mark_stack *stack) {
+  pthread_mutex_lock(&shared.lock);
+
+  for (int half = stack->count / 2; half > 0; half--) {
+    mark_stack_push(&shared.pool, stack->objects[--stack->count]);
   }
+
+  pthread_cond_broadcast(&shared.wake);
+  pthread_mutex_unlock(&shared.lock);
 }
 
-static void sweep() {
-  valp_obj *previous = NULL;
-  valp_obj *object = vm.objects;
-  
-  while (object != NULL) {
-    if (object->is_marked) {
-      object->is_marked = false;
-      previous = object;
-      object = object->next;
-    } else {
-      valp_obj *unreached = object;
+// Refills an empty stack from the pool. Returns false once there is no
+// work left anywhere.
+static bool take_work(valp_mark_stack *stack) {
+  pthread_mutex_lock(&shared.lock);
+  __atomic_add_fetch(&shared.idle, 1, __ATOMIC_RELAXED);
 
-      object = object->next;
-      if (previous != NULL) {
-        previous->next = object;
-      } else {
-        vm.objects = object;
-      }
+  while (shared.pool.count == 0 && shared.idle < shared.threads) {
+    pthread_cond_wait(&shared.wake, &shared.lock);
+  }
 
-      free_object(unreached);
-    }
+  if (shared.pool.count == 0) {
+    pthread_cond_broadcast(&shared.wake);
+    pthread_mutex_unlock(&shared.lock);
+    return false;
+  }
+
+  __atomic_sub_fetch(&shared.idle, 1, __ATOMIC_RELAXED);
+  for (int take = MARK_SHARE_THRESHOLD; take > 0 && shared.pool.count > 0; take--) {
+    mark_stack_push(stack, shared.pool.objects[--shared.pool.count]);
   }
+
+  pthread_mutex_unlock(&shared.lock);
+  return true;
 }
 
-void collect_garbage() {
-#ifdef DEBUG_LOG_GC
-  printf("== GC BEGIN ==\n");
+static void *mark_worker(void *unused) {
+  (void)unused;
+  valp_mark_stack stack = {NULL, 0, 0};
+  marker = &stack;
+
+  do {
+    while (stack.count > 0) {
+      blacken_object(stack.objects[--stack.count]);
+
+      if (stack.count > MARK_SHARE_THRESHOLD && __atomic_load_n(&shared.idle, __ATOMIC_RELAXED) > 0) {
+        share_work(&stack);
+      }
+    }
+  } while (take_work(&stack));
+
+  marker = NULL;
+  free(stack.objects);
+  return NULL;
+}
+
+// Drains the gray stack with vm.gc.threads markers, the calling thread
+// being one of them. The gray stack seeds the shared pool.
+static void trace_parallel() {
+  pthread_mutex_init(&shared.lock, NULL);
+  pthread_cond_init(&shared.wake, NULL);
+  shared.pool.objects = vm.gray_stack;
+  shared.pool.count = vm.gray_count;
+  shared.pool.capacity = vm.gray_capacity;
+  shared.idle = 0;
+  shared.threads = vm.gc.threads;
+
+  int started = 0;
+  pthread_t threads[GC_THREADS_MAX];
+  for (int i = 1; i < vm.gc.threads && i < GC_THREADS_MAX; i++) {
+    if (pthread_create(&threads[started], NULL, mark_worker, NULL) != 0) break;
+    started++;
+  }
+
+  // Count only the markers that actually run.
+  pthread_mutex_lock(&shared.lock);
+  shared.threads = started + 1;
+  pthread_cond_broadcast(&shared.wake);
+  pthread_mutex_unlock(&shared.lock);
+
+  mark_worker(NULL);
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  vm.gray_stack = shared.pool.objects;
+  vm.gray_count = 0;
+  vm.gray_capacity = shared.pool.capacity;
+  pthread_cond_destroy(&shared.wake);
+  pthread_mutex_destroy(&shared.lock);
+}
+#endif
+
+static void trace_references() {
+#ifdef PARALLEL_MARK
+  // Minor collections are too small to be worth starting threads for.
+  if (vm.gc.threads > 1 && !vm.collecting_young) {
+    trace_parallel();
+    return;
+  }
+#endif
+
+  while (vm.gray_count > 0) {
+    valp_obj *object = vm.gray_stack[--vm.gray_count];
+    blacken_object(object);
+  }
+}
+
+// Moves a young object to the old generation. Old objects on a page are
+// found through its bitmap, only large ones go on vm.objects.
+static void promote(valp_obj *object) {
+  object->is_old = true;
+
+  if (object->is_large) {
+    object->next = vm.objects;
+    vm.objects = object;
+  }
+}
+
+// Frees the unmarked objects on list and promotes the marked ones, leaving
+// list empty.
+static void sweep(valp_obj **list) {
+  valp_obj *object = *list;
+  *list = NULL;
+
+  while (object != NULL) {
+    valp_obj *next = object->next;
+
+    if (is_marked(object)) {
+      clear_marked(object);
+      promote(object);
+    } else {
+      free_object(object);
+    }
+
+    object = next;
+  }
+}
+
+// Moves the whole nursery to the old generation, where the sweep of a major
+// collection finds it.
+static void promote_young() {
+  while (vm.young != NULL) {
+    valp_obj *object = vm.young;
+    vm.young = object->next;
+    promote(object);
+  }
+}
+
+void remember_object(valp_obj *object) {
+  if (object->is_remembered) return;
+  object->is_remembered = true;
+
+  if (vm.remembered_capacity < vm.remembered_count + 1) {
+    vm.remembered_capacity = GROW_CAPACITY(vm.remembered_capacity);
+    vm.remembered = realloc(vm.remembered, sizeof(valp_obj*) * vm.remembered_capacity);
+
+    if (vm.remembered == NULL) out_of_memory();
+  }
+
+  vm.remembered[vm.remembered_count++] = object;
+}
+
+// After a collection the nursery is empty, so no old object can point into
+// it any more.
+static void forget_remembered() {
+  for (int i = 0; i < vm.remembered_count; i++) {
+    vm.remembered[i]->is_remembered = false;
+  }
+
+  vm.remembered_count = 0;
+  vm.young_bytes = 0;
+}
+
+// Minor collection. Traces from the roots and the remembered set through
+// young objects only, frees the unreached ones and promotes the rest.
+void collect_young() {
+#ifdef DEBUG_LOG_GC
+  printf("== MINOR GC BEGIN ==\n");
   size_t before = vm.bytes_allocated;
 #endif
 
+  begin_pause();
+  vm.gc_stats.minor_collections++;
+  vm.collecting_young = true;
+
+  mark_roots();
+  for (int i = 0; i < vm.remembered_count; i++) {
+    blacken_object(vm.remembered[i]);
+  }
+  trace_references();
+  hash_remove_white(&vm.strings);
+  sweep(&vm.young);
+  forget_remembered();
+
+  vm.collecting_young = false;
+  end_pause();
+
+#ifdef DEBUG_LOG_GC
+  printf("==  MINOR GC END  ==\n");
+  printf("   collected %ld bytes (from %ld to %ld)\n",
+           before - vm.bytes_allocated, before, vm.bytes_allocated);
+#endif
+}
+
+// The slow half of WRITE_BARRIER(), for owners that are old or marked.
+// While a major collection is marking, a value stored into an object the
+// marker has already reached is grayed, so no black object ever points at
+// a white one.
+void write_barrier(valp_obj *owner, valp_obj *value) {
+  if (owner->is_old && !value->is_old) remember_object(owner);
+  if (vm.gc_phase == GC_MARK && is_marked(owner)) mark_object(value);
+}
+
+// Major collections. With a step budget they run as a series of slices,
+// each blackening or sweeping at most vm.gc.step_budget objects, in
+// between allocations:
+//
+//   GC_MARK   The roots are grayed up front and the gray stack is drained
+//             a slice at a time. Objects allocated meanwhile start white
+//             in the nursery. Once the gray stack runs dry the roots,
+//             which have no barrier, are marked again and tracing
+//             finishes in one go.
+//   GC_SWEEP  The nursery is folded into the old generation. Slices walk
+//             vm.sweeping over the large objects and then the pages, and
+//             an allocation that finds no free slot sweeps the pages of
+//             its own size class first. Sweeping frees white objects and
+//             clears the marks of the others.
+//
+// Without a budget the same steps run back to back.
+
+static void start_marking() {
+#ifdef DEBUG_LOG_GC
+  printf("== GC BEGIN ==\n");
+#endif
+
+  vm.gc_stats.major_collections++;
+  vm.gc_before = vm.bytes_allocated;
+  mark_roots();
+  vm.gc_phase = GC_MARK;
+}
+
+// Marks up to budget more elements of the array being scanned, returning
+// how many it marked. Arrays are the one object that can be too big for a
+// slice, so they are taken apart. Elements stored behind the scan are
+// caught by the write barrier, as the array itself is marked.
+static int scan_array(int budget) {
+  valp_value_array *values = &vm.scanning->values;
+  int done = 0;
+
+  while (vm.scanned < values->count && done < budget) {
+    mark_value(values->values[vm.scanned++]);
+    done++;
+  }
+
+  if (vm.scanned >= values->count) vm.scanning = NULL;
+  return done;
+}
+
+static void finish_marking() {
+  if (vm.scanning != NULL) scan_array(INT_MAX);
   mark_roots();
   trace_references();
   hash_remove_white(&vm.strings);
-  sweep();
 
-  vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+  // Nothing old can point at a young object once there are none.
+  forget_remembered();
+  promote_young();
+
+  vm.sweeping = &vm.objects;
+  unsweep_slabs();
+#ifdef CONCURRENT_SWEEP
+  if (vm.gc.background_sweep) start_background_sweep();
+#endif
+  vm.gc_phase = GC_SWEEP;
+}
+
+// Sweeps up to budget large objects, then pages, a page costing what it
+// frees. Returns true when the sweep is done.
+static bool sweep_slice(int budget) {
+  while (*vm.sweeping != NULL && budget-- > 0) {
+    valp_obj *object = *vm.sweeping;
+
+    if (object->is_marked) {
+      object->is_marked = false;
+      vm.sweeping = &object->next;
+    } else {
+      *vm.sweeping = object->next;
+      free_object(object);
+    }
+  }
+
+#ifdef CONCURRENT_SWEEP
+  if (sweeper.running) return settle_swept(false) && *vm.sweeping == NULL;
+#endif
+
+  valp_slab_page *page;
+  while (budget > 0 && (page = next_unswept()) != NULL) {
+    budget -= sweep_page(page) + 1;
+  }
+
+  return *vm.sweeping == NULL && next_unswept() == NULL;
+}
+
+// Clamps the heap size that starts the next major collection.
+static size_t next_threshold(double size) {
+  if (vm.gc.max_heap > 0 && size > vm.gc.max_heap) size = vm.gc.max_heap;
+  if (size < vm.gc.min_heap) size = vm.gc.min_heap;
+  return (size_t)size;
+}
+
+static void finish_sweeping() {
+  vm.sweeping = NULL;
+  vm.gc_phase = GC_IDLE;
+  if (vm.gc.release) release_memory();
+  vm.next_gc = next_threshold(vm.bytes_allocated * vm.gc.grow_factor);
+  if (vm.gc.compact && !vm.compact_pending) {
+    vm.compact_pending = evacuable_pages() >= COMPACT_MIN_PAGES;
+  }
 
 #ifdef DEBUG_LOG_GC
   printf("==  GC END  ==\n");
   printf("   collected %ld bytes (from %ld to %ld) next at %ld\n",
-           before - vm.bytes_allocated, before, vm.bytes_allocated,
+           vm.gc_before - vm.bytes_allocated, vm.gc_before, vm.bytes_allocated,
            vm.next_gc);
 #endif
 }
 
-void free_objects() {
-  valp_obj *object = vm.objects;
+static void gc_step() {
+  begin_pause();
+  gc_slice(vm.gc.step_budget);
+  end_pause();
+}
+
+static void gc_slice(int budget) {
+  if (vm.gc_phase == GC_MARK) {
+    while (budget > 0) {
+      if (vm.scanning != NULL) {
+        budget -= scan_array(budget);
+        continue;
+      }
+
+      if (vm.gray_count == 0) break;
+
+      valp_obj *object = vm.gray_stack[--vm.gray_count];
+      if (object->type == OBJ_ARRAY) {
+        vm.scanning = (valp_array*)object;
+        vm.scanned = 0;
+      } else {
+        blacken_object(object);
+      }
+      budget--;
+    }
+
+    if (vm.gray_count > 0 || vm.scanning != NULL) return;
+    finish_marking();
+  }
+
+  if (vm.gc_phase == GC_SWEEP && sweep_slice(budget)) finish_sweeping();
+}
+
+// Runs whatever is left of the current major collection at once.
+static void finish_major() {
+  if (vm.gc_phase == GC_MARK) finish_marking();
+  if (vm.gc_phase == GC_SWEEP) {
+#ifdef CONCURRENT_SWEEP
+    settle_swept(true);
+#endif
+    sweep_slice(INT_MAX);
+    finish_sweeping();
+  }
+}
+
+static void start_major() {
+  begin_pause();
+  start_marking();
+
+  if (vm.gc.step_budget > 0) {
+    gc_slice(vm.gc.step_budget);
+  } else {
+    finish_marking();
+#ifdef CONCURRENT_SWEEP
+    // Sweep the large objects now and leave the pages to the sweeper, the
+    // allocations that follow settle them.
+    if (sweeper.running) {
+      if (sweep_slice(INT_MAX)) finish_sweeping();
+    } else {
+      finish_major();
+    }
+#else
+    finish_major();
+#endif
+  }
+
+  end_pause();
+}
+
+// Collects the whole heap before returning. A major collection that is
+// already running is finished first, as it may have kept objects that
+// died after it started.
+void collect_garbage() {
+  begin_pause();
+  finish_major();
+  start_marking();
+  finish_major();
+  end_pause();
+}
+
+// Compaction. A sweep leaves the survivors scattered over the pages they
+// were allocated on, and a page stays mapped while one object on it lives.
+// compact_heap() moves the objects off the sparsest pages of each size
+// class into the free slots of the other pages of the class, and hands the
+// emptied pages back. A moved object leaves its new address in the next
+// field of its old copy, whose page is marked evacuating. Then every
+// reference gets rewritten through those: the roots, the fields of all
+// objects, the keys and values of hashes, constants and vm.strings.
+//
+// C code holds raw object pointers in locals across allocations, so
+// objects only move at safe points. The interpreter calls compact_heap()
+// between instructions once vm.compact_pending is set, when no compiled
+// code or native is on the C stack. Large objects and the buffers objects
+// own stay where they are.
+
+// Pages at most this full get emptied, as long as the other pages of their
+// class have room for their objects.
+#define COMPACT_MAX_LIVE 0.5
+
+// The pages of the size class being planned.
+static struct {
+  valp_slab_page **pages;
+  int capacity;
+} compaction;
+
+static int by_live(const void *a, const void *b) {
+  int live_a = (*(valp_slab_page *const *)a)->live;
+  int live_b = (*(valp_slab_page *const *)b)->live;
+  return (live_a > live_b) - (live_a < live_b);
+}
+
+// Gathers the pages of a size class in compaction.pages, sparsest first,
+// and returns how many of the first ones compaction would empty. The
+// densest page always stays.
+static int plan_evacuation(int size_class) {
+  int count = 0;
+  int live = 0;
+
+  for (int state = SLAB_AVAILABLE; state <= SLAB_FULL; state++) {
+    valp_slab_page *page = slab_classes[size_class].pages[state];
+    for (; page != NULL; page = page->next) {
+      if (compaction.capacity < count + 1) {
+        compaction.capacity = GROW_CAPACITY(compaction.capacity);
+        compaction.pages = realloc(compaction.pages, sizeof(valp_slab_page*) * compaction.capacity);
+
+        if (compaction.pages == NULL) out_of_memory();
+      }
+      compaction.pages[count++] = page;
+      live += page->live;
+    }
+  }
+
+  qsort(compaction.pages, count, sizeof(valp_slab_page*), by_live);
+
+  int slots = (int)((SLAB_PAGE_SIZE - SLAB_HEADER) / SLAB_CLASS_SIZE(size_class));
+  int moving = 0;
+  int sources = 0;
+
+  while (sources < count - 1) {
+    int page_live = compaction.pages[sources]->live;
+    int room = (count - sources - 1) * slots - (live - moving - page_live);
+    if (page_live > slots * COMPACT_MAX_LIVE || moving + page_live > room) break;
+
+    moving += page_live;
+    sources++;
+  }
+
+  return sources;
+}
+
+static int evacuable_pages() {
+  int pages = 0;
+  for (int i = 0; i < SLAB_CLASSES; i++) pages += plan_evacuation(i);
+  return pages;
+}
+
+static void each_object(valp_slab_page *page, void (*visit)(valp_obj *object)) {
+  for (int i = 0; i < SLAB_BITMAP_WORDS; i++) {
+    for (uint64_t bits = page->allocated[i]; bits != 0; bits &= bits - 1) {
+      visit((valp_obj*)((uint8_t*)page + ((size_t)i * 64 + __builtin_ctzll(bits)) * SLAB_GRANULE));
+    }
+  }
+}
+
+// Copies an object to a page that stays and leaves its new address behind.
+static void evacuate(valp_obj *object) {
+  valp_obj *copy = slab_take(SLAB_PAGE_OF(object)->size_class);
+  memcpy(copy, object, object_size(object));
+
+  // A closed upvalue points at its own closed field.
+  if (object->type == OBJ_UPVALUE) {
+    valp_obj_upvalue *upvalue = (valp_obj_upvalue*)copy;
+    if (upvalue->location == &((valp_obj_upvalue*)object)->closed) {
+      upvalue->location = &upvalue->closed;
+    }
+  }
+
+  object->next = copy;
+}
+
+valp_obj *forward_object(valp_obj *object) {
+  if (object == NULL || object->is_large) return object;
+  return SLAB_PAGE_OF(object)->evacuating ? object->next : object;
+}
+
+void forward_value(valp_value *value) {
+  if (IS_OBJ(*value)) *value = OBJ_VAL(forward_object(AS_OBJ(*value)));
+}
+
+#define FORWARD(field) ((field) = (void*)forward_object((valp_obj*)(field)))
+
+static void forward_array(valp_value_array *array) {
+  for (int i = 0; i < array->count; i++) {
+    forward_value(&array->values[i]);
+  }
+}
+
+// Rewrites the references an object holds, following blacken_object().
+static void forward_fields(valp_obj *object) {
+  switch (object->type) {
+    case OBJ_BOUND_METHOD: {
+      valp_bound_method *bound = (valp_bound_method*)object;
+      forward_value(&bound->receiver);
+      FORWARD(bound->method);
+      break;
+    }
+    case OBJ_CLASS: {
+      valp_class *klass = (valp_class*)object;
+      FORWARD(klass->name);
+      FORWARD(klass->shape);
+      forward_hash(&klass->methods);
+      break;
+    }
+    case OBJ_CLOSURE: {
+      valp_obj_closure *closure = (valp_obj_closure*)object;
+      FORWARD(closure->function);
+      for (int i = 0; i < closure->upvalue_count; i++) {
+        FORWARD(closure->upvalues[i]);
+      }
+      break;
+    }
+    case OBJ_FUNCTION: {
+      valp_function *function = (valp_function*)object;
+      FORWARD(function->name);
+      forward_array(&function->bytecode.constants);
+      for (int i = 0; i < function->bytecode.cache_count; i++) {
+        valp_inline_cache *cache = &function->bytecode.caches[i];
+        for (int j = 0; j < cache->count; j++) {
+          FORWARD(cache->entries[j].shape);
+          FORWARD(cache->entries[j].next_shape);
+          FORWARD(cache->entries[j].method);
+        }
+      }
+      break;
+    }
+    case OBJ_INSTANCE: {
+      valp_instance *instance = (valp_instance*)object;
+      FORWARD(instance->klass);
+      FORWARD(instance->shape);
+      if (instance->shape != NULL) {
+        valp_value *slots = instance_slots(instance);
+        for (int i = 0; i < instance->shape->slot_count; i++) {
+          forward_value(&slots[i]);
+        }
+      }
+      if (instance->fields != NULL) forward_hash(instance->fields);
+      break;
+    }
+    case OBJ_SHAPE: {
+      valp_shape *shape = (valp_shape*)object;
+      FORWARD(shape->parent);
+      FORWARD(shape->name);
+      forward_hash(&shape->slots);
+      forward_hash(&shape->transitions);
+      break;
+    }
+    case OBJ_UPVALUE: {
+      valp_obj_upvalue *upvalue = (valp_obj_upvalue*)object;
+      forward_value(&upvalue->closed);
+      FORWARD(upvalue->next);
+      break;
+    }
+    case OBJ_ARRAY: {
+      valp_array *arr = (valp_array*)object;
+      forward_array(&arr->values);
+      break;
+    }
+    case OBJ_ROPE: {
+      valp_rope *rope = (valp_rope*)object;
+      FORWARD(rope->left);
+      FORWARD(rope->right);
+      FORWARD(rope->flat);
+      break;
+    }
+    case OBJ_NATIVE:
+    case OBJ_STRING:
+    case OBJ_STRING_BUILDER:
+      break;
+  }
+}
+
+// Rewrites what mark_roots() marks, and the weak references.
+static void forward_roots() {
+  for (valp_value *slot = vm.stack; slot < vm.stack_top; slot++) {
+    forward_value(slot);
+  }
+
+  for (int i = 0; i < vm.frame_count; i++) {
+    FORWARD(vm.frames[i].closure);
+  }
+
+  FORWARD(vm.open_upvalues);
+  for (int i = 0; i < vm.remembered_count; i++) {
+    FORWARD(vm.remembered[i]);
+  }
+
+  forward_hash(&vm.global_slots);
+  forward_array(&vm.globals);
+  forward_array(&vm.global_names);
+  forward_hash(&vm.constants);
+  forward_hash(&vm.strings);
+  forward_hash(&vm.array_methods);
+  forward_hash(&vm.string_methods);
+  forward_hash(&vm.string_builder_methods);
+  FORWARD(vm.init_string);
+}
+
+void compact_heap() {
+  begin_pause();
+
+  // References are followed out of every object left on the pages, so
+  // the dead ones have to go first.
+  collect_garbage();
+  vm.compact_pending = false;
+
+  valp_slab_page *evacuated = NULL;
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    int sources = plan_evacuation(i);
+    for (int j = 0; j < sources; j++) {
+      valp_slab_page *page = compaction.pages[j];
+      slab_unlink(page);
+      page->evacuating = true;
+      page->next = evacuated;
+      evacuated = page;
+    }
+  }
+
+  for (valp_slab_page *page = evacuated; page != NULL; page = page->next) {
+    each_object(page, evacuate);
+  }
+
+  for (int i = 0; i < SLAB_CLASSES; i++) {
+    for (int state = SLAB_AVAILABLE; state <= SLAB_FULL; state++) {
+      valp_slab_page *page = slab_classes[i].pages[state];
+      for (; page != NULL; page = page->next) each_object(page, forward_fields);
+    }
+  }
+  for (valp_obj *object = vm.objects; object != NULL; object = object->next) {
+    forward_fields(object);
+  }
+  forward_roots();
+
+  int emptied = 0;
+  while (evacuated != NULL) {
+    valp_slab_page *page = evacuated;
+    evacuated = page->next;
+
+    page->evacuating = false;
+    page->live = 0;
+    POISON_SLOT((uint8_t*)page + SLAB_HEADER, SLAB_PAGE_SIZE - SLAB_HEADER);
+    slab_link(page, SLAB_AVAILABLE);
+    release_slab_page(page);
+    emptied++;
+  }
+
+  if (vm.gc.release) release_memory();
+  vm.next_gc = next_threshold(vm.bytes_allocated * vm.gc.grow_factor);
+  vm.gc_stats.compactions++;
+  end_pause();
+
+#ifdef DEBUG_LOG_GC
+  printf("== COMPACTED %d pages, heap at %ld ==\n", emptied, vm.bytes_allocated);
+#else
+  (void)emptied;
+#endif
+}
+
+static void free_list(valp_obj *object) {
   while (object != NULL) {
     valp_obj *next = object->next;
     free_object(object);
     object = next;
   }
+}
+
+void free_objects() {
+#ifdef CONCURRENT_SWEEP
+  settle_swept(true);
+  free(sweeper.pages);
+  sweeper.pages = NULL;
+  sweeper.capacity = 0;
+#endif
+
+  free_list(vm.objects);
+  free_list(vm.young);
+  free_slabs();
 
   free(vm.gray_stack);
+  free(vm.remembered);
+  free(compaction.pages);
+  compaction.pages = NULL;
+  compaction.capacity = 0;
+}
+
+void gc_default_config(valp_gc_config *config) {
+  config->initial_heap = GC_INITIAL_HEAP;
+  config->grow_factor = GC_HEAP_GROW_FACTOR;
+  config->min_heap = 0;
+  config->max_heap = 0;
+  config->heap_limit = 0;
+  config->nursery_size = GC_NURSERY_SIZE;
+  config->step_budget = GC_STEP_BUDGET;
+  config->release = true;
+  config->compact = false;
+#ifdef PARALLEL_MARK
+  config->threads = GC_THREADS;
+#endif
+#ifdef CONCURRENT_SWEEP
+  config->background_sweep = true;
+#endif
+}
+
+typedef enum {
+  GC_OPTION_SIZE,
+  GC_OPTION_FACTOR,
+  GC_OPTION_INT,
+  GC_OPTION_FLAG,
+} valp_gc_option_type;
+
+typedef struct {
+  const char *name;
+  valp_gc_option_type type;
+  size_t offset;
+} valp_gc_option;
+
+static const valp_gc_option gc_options[] = {
+  {"initial-heap", GC_OPTION_SIZE, offsetof(valp_gc_config, initial_heap)},
+  {"grow-factor", GC_OPTION_FACTOR, offsetof(valp_gc_config, grow_factor)},
+  {"min-heap", GC_OPTION_SIZE, offsetof(valp_gc_config, min_heap)},
+  {"max-heap", GC_OPTION_SIZE, offsetof(valp_gc_config, max_heap)},
+  {"heap-limit", GC_OPTION_SIZE, offsetof(valp_gc_config, heap_limit)},
+  {"nursery-size", GC_OPTION_SIZE, offsetof(valp_gc_config, nursery_size)},
+  {"step-budget", GC_OPTION_INT, offsetof(valp_gc_config, step_budget)},
+  {"release", GC_OPTION_FLAG, offsetof(valp_gc_config, release)},
+  {"compact", GC_OPTION_FLAG, offsetof(valp_gc_config, compact)},
+#ifdef PARALLEL_MARK
+  {"threads", GC_OPTION_INT, offsetof(valp_gc_config, threads)},
+#endif
+#ifdef CONCURRENT_SWEEP
+  {"background-sweep", GC_OPTION_FLAG, offsetof(valp_gc_config, background_sweep)},
+#endif
+};
+
+#define GC_OPTIONS (int)(sizeof(gc_options) / sizeof(gc_options[0]))
+
+// Parses a byte count such as 512, 64K, 16M or 2G.
+static bool parse_size(const char *text, size_t *size) {
+  char *end;
+  unsigned long long value = strtoull(text, &end, 10);
+  if (end == text || *text == '-') return false;
+
+  switch (*end) {
+    case 'k': case 'K': value <<= 10; end++; break;
+    case 'm': case 'M': value <<= 20; end++; break;
+    case 'g': case 'G': value <<= 30; end++; break;
+    default: break;
+  }
+
+  if (*end != '\0') return false;
+  *size = (size_t)value;
+  return true;
+}
+
+bool gc_config_option(valp_gc_config *config, const char *name, const char *value) {
+  for (int i = 0; i < GC_OPTIONS; i++) {
+    const valp_gc_option *option = &gc_options[i];
+    if (strcmp(option->name, name) != 0) continue;
+
+    void *field = (uint8_t*)config + option->offset;
+    char *end;
+
+    switch (option->type) {
+      case GC_OPTION_SIZE:
+        return parse_size(value, (size_t*)field);
+      case GC_OPTION_FACTOR: {
+        double factor = strtod(value, &end);
+        if (end == value || *end != '\0' || !(factor >= 1)) return false;
+        *(double*)field = factor;
+        return true;
+      }
+      case GC_OPTION_INT: {
+        long count = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || count < 0 || count > INT_MAX) return false;
+        *(int*)field = (int)count;
+        return true;
+      }
+      case GC_OPTION_FLAG:
+        if (strcmp(value, "1") == 0 || strcmp(value, "on") == 0) {
+          *(bool*)field = true;
+        } else if (strcmp(value, "0") == 0 || strcmp(value, "off") == 0) {
+          *(bool*)field = false;
+        } else {
+          return false;
+        }
+        return true;
+    }
+  }
+
+  return false;
+}
+
+void gc_config_from_env(valp_gc_config *config) {
+  for (int i = 0; i < GC_OPTIONS; i++) {
+    // "heap-limit" is read from VALP_GC_HEAP_LIMIT.
+    char variable[64] = "VALP_GC_";
+    size_t length = strlen(variable);
+    for (const char *c = gc_options[i].name; *c != '\0'; c++) {
+      variable[length++] = *c == '-' ? '_' : (char)toupper(*c);
+    }
+    variable[length] = '\0';
+
+    const char *value = getenv(variable);
+    if (value != NULL && !gc_config_option(config, gc_options[i].name, value)) {
+      fprintf(stderr, "Ignoring invalid %s=%s.\n", variable, value);
+    }
+  }
+}
+
+void configure_gc(const valp_gc_config *config) {
+  vm.gc = *config;
+#ifdef PARALLEL_MARK
+  if (vm.gc.threads < 1) vm.gc.threads = 1;
+#endif
+
+  double grown = vm.bytes_allocated * vm.gc.grow_factor;
+  vm.next_gc = next_threshold(grown > vm.gc.initial_heap ? grown : vm.gc.initial_heap);
+}
+
+void gc_read_stats(valp_gc_stats *stats) {
+  const valp_gc_stats *counters = &vm.gc_stats;
+  stats->minor_collections = counters->minor_collections;
+  stats->major_collections = counters->major_collections;
+  stats->compactions = counters->compactions;
+  stats->pause_total_ns = counters->pause_total_ns;
+  stats->pause_max_ns = counters->pause_max_ns;
+  memcpy(stats->pauses, counters->pauses, sizeof(stats->pauses));
+  memcpy(stats->allocated_bytes, counters->allocated_bytes, sizeof(stats->allocated_bytes));
+  memcpy(stats->allocated_objects, counters->allocated_objects, sizeof(stats->allocated_objects));
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    stats->freed_bytes[i] = READ_FREED(counters->freed_bytes[i]);
+    stats->freed_objects[i] = READ_FREED(counters->freed_objects[i]);
+  }
 }
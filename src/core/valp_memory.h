@@ -9,6 +9,9 @@
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
+// Objects come from the size-class slabs, see slab_allocate.
+#define FREE_OBJ(type, pointer) slab_free(pointer, sizeof(type))
+
 #define GROW_CAPACITY(capacity) \
     ((capacity) < 8 ? 8 : (capacity) * 2)
 
@@ -19,10 +22,149 @@
 #define FREE_ARRAY(type, pointer, old_count) \
     reallocate(pointer, sizeof(type) * (old_count), 0)
 
+// Objects up to SLAB_MAX bytes are carved from pages of SLAB_PAGE_SIZE
+// bytes, in size classes SLAB_GRANULE bytes apart.
+#define SLAB_GRANULE 16
+#define SLAB_MAX 256
+#define SLAB_CLASSES (SLAB_MAX / SLAB_GRANULE)
+#define SLAB_PAGE_SIZE (64 * 1024)
+// Emptied pages kept for reuse rather than freed, enough for a nursery.
+#ifndef SLAB_EMPTY_MAX
+#define SLAB_EMPTY_MAX (GC_NURSERY_SIZE / SLAB_PAGE_SIZE * 2)
+#endif
+
+// Defaults for valp_gc_config.
+
+// Heap size that starts the first major collection.
+#ifndef GC_INITIAL_HEAP
+#define GC_INITIAL_HEAP (1024 * 1024)
+#endif
+
+// After a major collection the next one starts once the heap has grown
+// by this factor.
+#ifndef GC_HEAP_GROW_FACTOR
+#define GC_HEAP_GROW_FACTOR 2
+#endif
+
+// Bytes allocated since the last collection that start a minor one.
+#ifndef GC_NURSERY_SIZE
+#define GC_NURSERY_SIZE (256 * 1024)
+#endif
+
+// Objects a major collection blackens or sweeps per slice.
+#ifndef GC_STEP_BUDGET
+#define GC_STEP_BUDGET 1000
+#endif
+
+#ifdef PARALLEL_MARK
+// Threads that mark a full collection.
+#ifndef GC_THREADS
+#define GC_THREADS 4
+#endif
+#define GC_THREADS_MAX 256
+#endif
+
+// Collector settings. Sizes are in bytes, and 0 leaves a bound off.
+typedef struct {
+  size_t initial_heap;
+  double grow_factor;
+  // Bounds for the heap size that starts the next major collection.
+  // Below max_heap the heap grows by grow_factor, past it every major
+  // collection is followed by the next.
+  size_t min_heap;
+  size_t max_heap;
+  // Hard cap. An allocation past it that a full collection cannot make
+  // room for makes the script stop with an "Out of memory" runtime error.
+  size_t heap_limit;
+  size_t nursery_size;
+  // Work per slice of a major collection, 0 makes them stop the world.
+  int step_budget;
+  // Give unused memory back to the system after each major collection.
+  bool release;
+  // Move objects together when a major collection leaves the pages
+  // fragmented, see compact_heap().
+  bool compact;
+#ifdef PARALLEL_MARK
+  int threads;
+#endif
+#ifdef CONCURRENT_SWEEP
+  // Hand the pages of a major collection to a background sweeper.
+  bool background_sweep;
+#endif
+} valp_gc_config;
+
+// Pauses are counted in buckets by length: bucket 0 holds those under a
+// microsecond, bucket i those under 2^i microseconds and the last one the
+// rest.
+#define GC_PAUSE_BUCKETS 20
+
+// Counters kept since init_vm(). Bytes per type are those of the objects
+// themselves, not of the buffers they own.
+typedef struct {
+  uint64_t minor_collections;
+  uint64_t major_collections;
+  uint64_t compactions;
+  // Every minor collection and every slice of a major one is a pause.
+  uint64_t pause_total_ns;
+  uint64_t pause_max_ns;
+  uint64_t pauses[GC_PAUSE_BUCKETS];
+  uint64_t allocated_bytes[OBJ_TYPE_COUNT];
+  uint64_t freed_bytes[OBJ_TYPE_COUNT];
+  uint64_t allocated_objects[OBJ_TYPE_COUNT];
+  uint64_t freed_objects[OBJ_TYPE_COUNT];
+} valp_gc_stats;
+
+// Has to follow every store of a reference into an object. It keeps old
+// objects that now point at a young one in the remembered set, and grays
+// values stored into objects an incremental collection already marked.
+// Mark bits mostly live in page bitmaps, so while marking every store
+// takes the slow path.
+#define WRITE_BARRIER(owner, value) \
+    do { \
+      valp_value barrier_value = (value); \
+      valp_obj *barrier_owner = (valp_obj*)(owner); \
+      if ((barrier_owner->is_old || vm.gc_phase == GC_MARK) && \
+          IS_OBJ(barrier_value) && AS_OBJ(barrier_value) != NULL) { \
+        write_barrier(barrier_owner, AS_OBJ(barrier_value)); \
+      } \
+    } while (false)
+
 void* reallocate(void *pointer, size_t old_size, size_t new_size);
+// For memory the system would not give us even after a full collection.
+// Reports it and exits.
+void out_of_memory();
+// Allocates without running the collector, for memory the collector itself
+// needs while it runs. Free it with reallocate() as usual.
+void *gc_allocate(size_t size);
+
+// Embedding API. Fill a config with gc_default_config(), change it by hand
+// or with gc_config_option() and gc_config_from_env(), then hand it to
+// configure_gc() after init_vm().
+void gc_default_config(valp_gc_config *config);
+// Sets the option name (e.g. "heap-limit") from text, sizes taking a K, M
+// or G suffix. Returns false for unknown names and bad values.
+bool gc_config_option(valp_gc_config *config, const char *name, const char *value);
+// Applies the VALP_GC_* environment variables, e.g. VALP_GC_HEAP_LIMIT.
+void gc_config_from_env(valp_gc_config *config);
+void configure_gc(const valp_gc_config *config);
+// Copies the counters of vm.gc_stats.
+void gc_read_stats(valp_gc_stats *stats);
+void *slab_allocate(size_t size);
+void slab_free(void *pointer, size_t size);
+bool is_white(valp_obj *object);
 void mark_value(valp_value value);
 void mark_object(valp_obj *object);
+void remember_object(valp_obj *object);
+void write_barrier(valp_obj *owner, valp_obj *value);
+void collect_young();
 void collect_garbage();
+// Collects the whole heap and moves the objects on sparse slab pages
+// together. Only safe where no C code holds object pointers, which the
+// interpreter checks before it calls this for vm.compact_pending.
+void compact_heap();
+// The address of an object once compact_heap() moved it.
+valp_obj *forward_object(valp_obj *object);
+void forward_value(valp_value *value);
 void free_objects();
 
 #endif
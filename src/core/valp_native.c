@@ -1,6 +1,8 @@
+#include <string.h>
 #include <time.h>
 
 #include "../include/valp.h"
+#include "valp_memory.h"
 #include "valp_native.h"
 #include "valp_object.h"
 #include "valp_vm.h"
@@ -37,6 +39,112 @@ static valp_value assert_equal_native(int arg_count, valp_value *args) {
   return NIL_VAL;
 }
 
+// Names of the per type counters, by valp_obj_type.
+static const char *gc_type_names[OBJ_TYPE_COUNT] = {
+  "bound_methods", "classes", "closures", "functions", "instances",
+  "natives", "strings", "upvalues", "arrays", "shapes", "ropes",
+  "string_builders",
+};
+
+// Pushes a new instance of a new class called name.
+static valp_instance *push_record(const char *name) {
+  push(OBJ_VAL(copy_string(name, (int)strlen(name))));
+  valp_class *klass = new_class(AS_STRING(vm.stack_top[-1]));
+  pop();
+  push(OBJ_VAL(klass));
+  valp_instance *instance = new_instance(klass);
+  pop();
+  push(OBJ_VAL(instance));
+  return instance;
+}
+
+// Sets a field of the record on top of the stack and pops value.
+static void set_record_field(const char *name) {
+  valp_instance *record = AS_INSTANCE(vm.stack_top[-2]);
+  push(OBJ_VAL(copy_string(name, (int)strlen(name))));
+  instance_set_field(record, AS_STRING(vm.stack_top[-1]), vm.stack_top[-2]);
+  pop();
+  pop();
+}
+
+static void push_type_counts(const uint64_t *counts) {
+  push_record("GcTypeStats");
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    push(NUMBER_VAL((double)counts[i]));
+    set_record_field(gc_type_names[i]);
+  }
+}
+
+// Returns the collector counters: collection counts, pause times in
+// seconds, pause counts by length (see GC_PAUSE_BUCKETS), the heap size,
+// and per object type the bytes allocated and freed and the live objects.
+static valp_value gc_stats_native(int arg_count, valp_value *args) {
+  if (arg_count != 0) {
+    runtime_error("gc_stats() expected 0 arguments, got %d.", arg_count);
+    return UNDEFINED_VAL;
+  }
+
+  valp_gc_stats stats;
+  gc_read_stats(&stats);
+
+  push_record("GcStats");
+
+  push(NUMBER_VAL((double)stats.minor_collections));
+  set_record_field("minor");
+  push(NUMBER_VAL((double)stats.major_collections));
+  set_record_field("major");
+  push(NUMBER_VAL((double)stats.compactions));
+  set_record_field("compactions");
+  push(NUMBER_VAL(stats.pause_total_ns / 1e9));
+  set_record_field("pause_total");
+  push(NUMBER_VAL(stats.pause_max_ns / 1e9));
+  set_record_field("pause_max");
+  push(NUMBER_VAL((double)vm.bytes_allocated));
+  set_record_field("heap");
+
+  valp_array *pauses = new_array();
+  push(OBJ_VAL(pauses));
+  for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+    write_valp_value_array(&pauses->values, NUMBER_VAL((double)stats.pauses[i]));
+  }
+  set_record_field("pauses");
+
+  push_type_counts(stats.allocated_bytes);
+  set_record_field("allocated");
+  push_type_counts(stats.freed_bytes);
+  set_record_field("freed");
+
+  uint64_t live[OBJ_TYPE_COUNT];
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    live[i] = stats.allocated_objects[i] - stats.freed_objects[i];
+  }
+  push_type_counts(live);
+  set_record_field("live");
+
+  return pop();
+}
+
+// Asks for a compaction of the heap, which runs at the next loop
+// iteration of the interpreter.
+static valp_value gc_compact_native(int arg_count, valp_value *args) {
+  if (arg_count != 0) {
+    runtime_error("gc_compact() expected 0 arguments, got %d.", arg_count);
+    return UNDEFINED_VAL;
+  }
+
+  vm.compact_pending = true;
+  return NIL_VAL;
+}
+
+static valp_value string_builder_native(int arg_count, valp_value *args) {
+  if (arg_count != 0) {
+    runtime_error("StringBuilder() expected 0 arguments, got %d.", arg_count);
+    return UNDEFINED_VAL;
+  }
+
+  return OBJ_VAL(new_string_builder());
+}
+
 void define_native(valp_hash *hash, const char* name, valp_native_fn function) {
   push(OBJ_VAL(copy_string(name, (int)strlen(name))));
   push(OBJ_VAL(new_native(function)));
@@ -48,11 +156,20 @@ void define_native(valp_hash *hash, const char* name, valp_native_fn function) {
 }
 
 void define_natives() {
-  char *natives[] = { "clock", "assert", "assert_equal" };
+  char *natives[] = { "clock", "assert", "assert_equal", "gc_stats", "gc_compact",
+                      "StringBuilder" };
 
-  valp_native_fn natives_f[] = { clock_native, assert_native, assert_equal_native };
+  valp_native_fn natives_f[] = { clock_native, assert_native, assert_equal_native, gc_stats_native,
+                                 gc_compact_native, string_builder_native };
 
   for (int i = 0; i < sizeof(natives) / sizeof(natives[0]); ++i) {
-    define_native(&vm.globals, natives[i], natives_f[i]);
+    push(OBJ_VAL(copy_string(natives[i], (int)strlen(natives[i]))));
+    push(OBJ_VAL(new_native(natives_f[i])));
+
+    int slot = global_slot(AS_STRING(vm.stack[0]));
+    vm.globals.values[slot] = vm.stack[1];
+
+    pop();
+    pop();
   }
 }
\ No newline at end of file
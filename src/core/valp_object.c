@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "valp_memory.h"
@@ -10,12 +11,18 @@
 #define ALLOCATE_OBJ(type, object_type) (type*)allocate_object(sizeof(type), object_type)
 
 static valp_obj *allocate_object(size_t size, valp_obj_type type) {
-  valp_obj *object = (valp_obj*)reallocate(NULL, 0, size);
+  valp_obj *object = (valp_obj*)slab_allocate(size);
   object->type = type;
+  object->is_large = size > SLAB_MAX;
   object->is_marked = false;
-  
-  object->next = vm.objects;
-  vm.objects = object;
+  object->is_old = false;
+  object->is_remembered = false;
+
+  object->next = vm.young;
+  vm.young = object;
+
+  vm.gc_stats.allocated_bytes[type] += size;
+  vm.gc_stats.allocated_objects[type]++;
 
 #ifdef DEBUG_LOG_GC
   printf("%p allocate %ld for %d\n", (void*)object, size, type);
@@ -34,7 +41,16 @@ valp_bound_method *new_bound_method(valp_value receiver, valp_obj_closure *metho
 valp_class *new_class(valp_string *name) {
   valp_class *klass = ALLOCATE_OBJ(valp_class, OBJ_CLASS);
   klass->name = name;
+  klass->shape = NULL;
+  klass->slot_hint = 0;
   init_hash(&klass->methods);
+  klass->methods.owner = (valp_obj*)klass;
+
+  push(OBJ_VAL(klass));
+  klass->shape = new_shape(NULL, NULL);
+  WRITE_BARRIER(klass, OBJ_VAL(klass->shape));
+  pop();
+
   return klass;
 }
 
@@ -57,19 +73,165 @@ valp_function *new_function() {
 
   function->arity = 0;
   function->upvalue_count = 0;
+  function->max_stack = 0;
   function->name = NULL;
   init_bytecode(&function->bytecode);
+#ifdef JIT
+  function->call_count = 0;
+  function->jit_failed = false;
+  function->jit_code = NULL;
+  function->jit_size = 0;
+#endif
 
   return function;
 }
 
 valp_instance *new_instance(valp_class *klass) {
-  valp_instance *instance = ALLOCATE_OBJ(valp_instance, OBJ_INSTANCE);
+  // Reserve inline room for as many fields as earlier instances of the
+  // class ended up with.
+  int inline_capacity = klass->slot_hint;
+  size_t size = sizeof(valp_instance) + sizeof(valp_value) * inline_capacity;
+
+  valp_instance *instance = (valp_instance*)allocate_object(size, OBJ_INSTANCE);
   instance->klass = klass;
-  init_hash(&instance->fields);
+  instance->shape = klass->shape;
+  instance->fields = NULL;
+  instance->slots = NULL;
+  instance->slot_capacity = inline_capacity;
+  instance->inline_capacity = inline_capacity;
   return instance;
 }
 
+valp_shape *new_shape(valp_shape *parent, valp_string *name) {
+  valp_shape *shape = ALLOCATE_OBJ(valp_shape, OBJ_SHAPE);
+  shape->parent = parent;
+  shape->name = name;
+  shape->slot_count = 0;
+  init_hash(&shape->slots);
+  init_hash(&shape->transitions);
+  shape->slots.owner = (valp_obj*)shape;
+  shape->transitions.owner = (valp_obj*)shape;
+
+  if (parent != NULL) {
+    push(OBJ_VAL(shape));
+    hash_add_all(&parent->slots, &shape->slots);
+    hash_set(&shape->slots, name, NUMBER_VAL(parent->slot_count));
+    shape->slot_count = parent->slot_count + 1;
+    pop();
+  }
+
+  return shape;
+}
+
+int shape_slot(valp_shape *shape, valp_string *name) {
+  valp_value slot;
+  if (!hash_get(&shape->slots, name, &slot)) return -1;
+
+  return (int)AS_NUMBER(slot);
+}
+
+static valp_shape *shape_transition(valp_shape *shape, valp_string *name) {
+  valp_value next;
+  if (hash_get(&shape->transitions, name, &next)) return (valp_shape*)AS_OBJ(next);
+
+  if (shape->slot_count >= SHAPE_MAX_SLOTS || shape->transitions.count >= SHAPE_MAX_TRANSITIONS) {
+    return NULL;
+  }
+
+  valp_shape *child = new_shape(shape, name);
+  push(OBJ_VAL(child));
+  hash_set(&shape->transitions, name, OBJ_VAL(child));
+  pop();
+
+  return child;
+}
+
+static void ensure_slot_capacity(valp_instance *instance, int count) {
+  if (count <= instance->slot_capacity) return;
+
+  int old_capacity = instance->slot_capacity;
+  int capacity = GROW_CAPACITY(old_capacity);
+
+  if (instance->slots == NULL) {
+    valp_value *slots = ALLOCATE(valp_value, capacity);
+    memcpy(slots, instance->inline_slots, sizeof(valp_value) * old_capacity);
+    instance->slots = slots;
+  } else {
+    instance->slots = GROW_ARRAY(valp_value, instance->slots, old_capacity, capacity);
+  }
+
+  instance->slot_capacity = capacity;
+}
+
+static void make_dictionary(valp_instance *instance) {
+  valp_hash *fields = ALLOCATE(valp_hash, 1);
+  init_hash(fields);
+  fields->owner = (valp_obj*)instance;
+  instance->fields = fields;
+
+  valp_value *slots = instance_slots(instance);
+  for (valp_shape *shape = instance->shape; shape->parent != NULL; shape = shape->parent) {
+    hash_set(fields, shape->name, slots[shape->slot_count - 1]);
+  }
+
+  if (instance->slots != NULL) {
+    FREE_ARRAY(valp_value, instance->slots, instance->slot_capacity);
+    instance->slots = NULL;
+  }
+
+  instance->slot_capacity = instance->inline_capacity;
+  instance->shape = NULL;
+}
+
+bool instance_get_field(valp_instance *instance, valp_string *name, valp_value *value) {
+  if (instance->shape == NULL) return hash_get(instance->fields, name, value);
+
+  int slot = shape_slot(instance->shape, name);
+  if (slot == -1) return false;
+
+  *value = instance_slots(instance)[slot];
+  return true;
+}
+
+// Both instance and value have to be reachable by the GC, as adding a new
+// field may allocate.
+void instance_set_field(valp_instance *instance, valp_string *name, valp_value value) {
+  if (instance->shape == NULL) {
+    hash_set(instance->fields, name, value);
+    return;
+  }
+
+  int slot = shape_slot(instance->shape, name);
+  if (slot != -1) {
+    instance_slots(instance)[slot] = value;
+    WRITE_BARRIER(instance, value);
+    return;
+  }
+
+  valp_shape *next = shape_transition(instance->shape, name);
+  if (next == NULL) {
+    make_dictionary(instance);
+    hash_set(instance->fields, name, value);
+    return;
+  }
+
+  instance_append_field(instance, next, value);
+}
+
+// Moves instance to next, a direct successor of its current shape, and
+// stores value in the slot that was added.
+void instance_append_field(valp_instance *instance, valp_shape *next, valp_value value) {
+  ensure_slot_capacity(instance, next->slot_count);
+  instance_slots(instance)[next->slot_count - 1] = value;
+  instance->shape = next;
+  WRITE_BARRIER(instance, value);
+  WRITE_BARRIER(instance, OBJ_VAL(next));
+
+  if (next->slot_count > instance->klass->slot_hint) {
+    instance->klass->slot_hint = next->slot_count;
+  }
+}
+
 valp_obj_native *new_native(valp_native_fn function) {
   valp_obj_native *native = ALLOCATE_OBJ(valp_obj_native, OBJ_NATIVE);
   native->function = function;
@@ -77,16 +239,16 @@ valp_obj_native *new_native(valp_native_fn function) {
   return native;
 }
 
-static valp_string *allocate_string(char *chars, int length, uint32_t hash) {
-  valp_string *string = ALLOCATE_OBJ(valp_string, OBJ_STRING);
+// Allocates a string of length characters for the caller to fill in. It
+// is neither hashed nor interned yet.
+static valp_string *allocate_string(int length) {
+  valp_string *string = (valp_string*)allocate_object(sizeof(valp_string) + length + 1, OBJ_STRING);
   string->length = length;
-  string->chars = chars;
-  string->hash = hash;
-
-  push(OBJ_VAL(string));
-  hash_set(&vm.strings, string, NIL_VAL);
-  pop();
-
+  string->hash = 0;
+  string->hashed = false;
+  string->interned = false;
+  string->changed = false;
+  string->chars[length] = '\0';
   return string;
 }
 
@@ -101,16 +263,41 @@ static uint32_t hash_string(const char* key, int length) {
   return hash;
 }
 
-valp_string *take_string(char *chars, int length) {
-  uint32_t hash = hash_string(chars, length);
-  valp_string *interned = hash_find_string(&vm.strings, chars, length, hash);
+uint32_t string_hash(valp_string *string) {
+  if (!string->hashed) {
+    string->hash = hash_string(string->chars, string->length);
+    string->hashed = true;
+  }
+  return string->hash;
+}
+
+valp_string *intern_string(valp_string *string) {
+  if (string->interned) return string;
+
+  uint32_t hash = string_hash(string);
+  valp_string *interned = hash_find_string(&vm.strings, string->chars, string->length, hash);
+  if (interned != NULL) return interned;
+
+  string->interned = true;
+  push(OBJ_VAL(string));
+  hash_set(&vm.strings, string, NIL_VAL);
+  pop();
+
+  return string;
+}
 
-  if (interned != NULL) {
-    FREE_ARRAY(char, chars, length + 1);
-    return interned;
+void string_changed(valp_string *string) {
+  if (string->interned) {
+    string->changed = true;
+  } else {
+    string->hashed = false;
   }
+}
 
-  return allocate_string(chars, length, hash);
+valp_string *new_string(const char *chars, int length) {
+  valp_string *string = allocate_string(length);
+  memcpy(string->chars, chars, length);
+  return string;
 }
 
 valp_string *copy_string(const char *chars, int length) {
@@ -119,11 +306,118 @@ valp_string *copy_string(const char *chars, int length) {
 
   if (interned != NULL) return interned;
 
-  char *heap_chars = ALLOCATE(char, length + 1);
-  memcpy(heap_chars, chars, length);
-  heap_chars[length] = '\0';
+  valp_string *string = new_string(chars, length);
+  string->hash = hash;
+  string->hashed = true;
+  return intern_string(string);
+}
+
+// a and b have to be reachable, the allocation may collect.
+valp_string *concat_strings(valp_string *a, valp_string *b) {
+  valp_string *string = allocate_string(a->length + b->length);
+  memcpy(string->chars, a->chars, a->length);
+  memcpy(string->chars + a->length, b->chars, b->length);
+  return string;
+}
 
-  return allocate_string(heap_chars, length, hash);
+static int text_length(valp_obj *text) {
+  if (text->type == OBJ_STRING) return ((valp_string*)text)->length;
+  return ((valp_rope*)text)->length;
+}
+
+// A flattened rope stands for its string.
+static valp_obj *text_piece(valp_obj *text) {
+  if (text->type == OBJ_ROPE && ((valp_rope*)text)->flat != NULL) {
+    return (valp_obj*)((valp_rope*)text)->flat;
+  }
+  return text;
+}
+
+// Concatenates two strings or ropes, which have to be reachable. Short
+// results are strings right away, long ones ropes.
+valp_obj *concat_text(valp_obj *a, valp_obj *b) {
+  a = text_piece(a);
+  b = text_piece(b);
+
+  if (text_length(b) == 0) return a;
+  if (text_length(a) == 0) return b;
+
+  int length = text_length(a) + text_length(b);
+  if (length < ROPE_MIN && a->type == OBJ_STRING && b->type == OBJ_STRING) {
+    return (valp_obj*)concat_strings((valp_string*)a, (valp_string*)b);
+  }
+
+  valp_rope *rope = ALLOCATE_OBJ(valp_rope, OBJ_ROPE);
+  rope->length = length;
+  rope->left = a;
+  rope->right = b;
+  rope->flat = NULL;
+  return (valp_obj*)rope;
+}
+
+// Copies the characters of text so they end right before end. Goes from
+// the back, so the left-leaning ropes appending builds need no stack.
+static void write_text(valp_obj *text, char *end) {
+  valp_obj **pending = NULL;
+  int count = 0;
+  int capacity = 0;
+
+  for (;;) {
+    text = text_piece(text);
+
+    if (text->type == OBJ_ROPE) {
+      if (capacity < count + 1) {
+        capacity = GROW_CAPACITY(capacity);
+        pending = realloc(pending, sizeof(valp_obj*) * capacity);
+
+        if (pending == NULL) out_of_memory();
+      }
+      pending[count++] = ((valp_rope*)text)->left;
+      text = ((valp_rope*)text)->right;
+      continue;
+    }
+
+    valp_string *string = (valp_string*)text;
+    end -= string->length;
+    memcpy(end, string->chars, string->length);
+
+    if (count == 0) break;
+    text = pending[--count];
+  }
+
+  free(pending);
+}
+
+// rope has to be reachable.
+valp_string *flatten_rope(valp_rope *rope) {
+  if (rope->flat != NULL) return rope->flat;
+
+  valp_string *string = allocate_string(rope->length);
+  write_text((valp_obj*)rope, string->chars + rope->length);
+
+  rope->flat = string;
+  rope->left = NULL;
+  rope->right = NULL;
+  WRITE_BARRIER(rope, OBJ_VAL(string));
+  return string;
+}
+
+// The string text is made of, flattening a rope for good.
+static valp_string *text_string(valp_obj *text) {
+  if (text->type == OBJ_ROPE) return flatten_rope((valp_rope*)text);
+  return (valp_string*)text;
+}
+
+bool text_equal(valp_obj *a, valp_obj *b) {
+  a = text_piece(a);
+  b = text_piece(b);
+
+  if (a == b) return true;
+  if (text_length(a) != text_length(b)) return false;
+
+  valp_string *a_string = text_string(a);
+  valp_string *b_string = text_string(b);
+  return memcmp(a_string->chars, b_string->chars, a_string->length) == 0;
 }
 
 valp_obj_upvalue *new_upvalue(valp_value *slot) {
@@ -141,6 +435,14 @@ valp_array *new_array() {
   return array;
 }
 
+valp_string_builder *new_string_builder() {
+  valp_string_builder *builder = ALLOCATE_OBJ(valp_string_builder, OBJ_STRING_BUILDER);
+  builder->chars = NULL;
+  builder->length = 0;
+  builder->capacity = 0;
+  return builder;
+}
+
 static void print_function(valp_function *function) {
   if (function->name == NULL) {
     printf("<script>");
@@ -179,5 +481,12 @@ void print_object(valp_value value) {
     case OBJ_STRING:       printf("%s", AS_CSTRING(value)); break;
     case OBJ_UPVALUE:      printf("upvalue"); break;
     case OBJ_ARRAY:        print_array(AS_ARRAY(value)); break;
+    case OBJ_SHAPE:        printf("shape"); break;
+    case OBJ_ROPE:         printf("%s", flatten_rope(AS_ROPE(value))->chars); break;
+    case OBJ_STRING_BUILDER: {
+      valp_string_builder *builder = AS_STRING_BUILDER(value);
+      fwrite(builder->chars, 1, builder->length, stdout);
+      break;
+    }
   }
 }
\ No newline at end of file
@@ -16,6 +16,10 @@
 #define IS_NATIVE(value)       is_obj_type(value, OBJ_NATIVE)
 #define IS_STRING(value)       is_obj_type(value, OBJ_STRING)
 #define IS_ARRAY(value)        is_obj_type(value, OBJ_ARRAY)
+#define IS_ROPE(value)         is_obj_type(value, OBJ_ROPE)
+#define IS_STRING_BUILDER(value) is_obj_type(value, OBJ_STRING_BUILDER)
+// Strings and ropes, which scripts see as strings both.
+#define IS_TEXT(value)         (IS_STRING(value) || IS_ROPE(value))
 
 #define AS_BOUND_METHOD(value) ((valp_bound_method*)AS_OBJ(value))
 #define AS_CLASS(value)        ((valp_class*)AS_OBJ(value))
@@ -26,6 +30,13 @@
 #define AS_STRING(value)       ((valp_string*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((valp_string*)AS_OBJ(value))->chars)
 #define AS_ARRAY(value)        ((valp_array*)AS_OBJ(value))
+#define AS_ROPE(value)         ((valp_rope*)AS_OBJ(value))
+#define AS_STRING_BUILDER(value) ((valp_string_builder*)AS_OBJ(value))
+
+// Concatenations at least this long make a rope instead of a string.
+#ifndef ROPE_MIN
+#define ROPE_MIN 64
+#endif
 
 typedef enum {
   OBJ_BOUND_METHOD,
@@ -37,11 +48,23 @@ typedef enum {
   OBJ_STRING,
   OBJ_UPVALUE,
   OBJ_ARRAY,
+  OBJ_SHAPE,
+  OBJ_ROPE,
+  OBJ_STRING_BUILDER,
 } valp_obj_type;
 
+#define OBJ_TYPE_COUNT (OBJ_STRING_BUILDER + 1)
+
 struct valp_obj {
   valp_obj_type type;
+  // Too big for the slabs. Only large objects keep their mark bit here,
+  // the others have theirs in the bitmap of their page.
+  bool is_large;
   bool is_marked;
+  // Survived a collection and left vm.young. Large ones live on vm.objects.
+  bool is_old;
+  // In vm.remembered, see WRITE_BARRIER().
+  bool is_remembered;
   struct valp_obj* next;
 };
 
@@ -49,8 +72,17 @@ typedef struct {
   valp_obj obj;
   int arity;
   int upvalue_count;
+  // The most values a frame running the function holds at once, counting
+  // the callee and the arguments. call() reserves this much stack.
+  int max_stack;
   valp_bytecode bytecode;
   valp_string *name;
+#ifdef JIT
+  int call_count;
+  bool jit_failed;
+  void *jit_code;
+  size_t jit_size;
+#endif
 } valp_function;
 
 typedef valp_value (*valp_native_fn)(int arg_count, valp_value *args);
@@ -60,11 +92,20 @@ typedef struct {
   valp_native_fn function;
 } valp_obj_native;
 
+// The characters follow the header in the same allocation, terminated by
+// a '\0' that length does not count. Identifiers and literals are interned
+// in vm.strings as they are made, strings made at runtime only when they
+// have to be, and are hashed the first time they are compared.
 struct valp_string {
   valp_obj obj;
   int length;
-  char *chars;
   uint32_t hash;
+  bool hashed;
+  bool interned;
+  // An interned string changed in place. Its hash still finds it in the
+  // tables it keys, but no longer matches its characters.
+  bool changed;
+  char chars[];
 };
 
 struct valp_array{
@@ -72,6 +113,26 @@ struct valp_array{
   valp_value_array values;
 };
 
+// A concatenation not carried out yet, so appending to a long string does
+// not copy it. left and right are strings or ropes. The characters are put
+// together when something needs them in one piece, then flat holds the
+// string and the halves are let go.
+typedef struct {
+  valp_obj obj;
+  int length;
+  valp_obj *left;
+  valp_obj *right;
+  valp_string *flat;
+} valp_rope;
+
+// A growable buffer scripts append text to, see types/string_builder.c.
+typedef struct {
+  valp_obj obj;
+  char *chars;
+  int length;
+  int capacity;
+} valp_string_builder;
+
 typedef struct valp_obj_upvalue {
   valp_obj obj;
   valp_value *location;
@@ -79,23 +140,51 @@ typedef struct valp_obj_upvalue {
   struct valp_obj_upvalue *next;
 } valp_obj_upvalue;
 
-typedef struct {
+struct valp_obj_closure {
   valp_obj obj;
   valp_function *function;
   valp_obj_upvalue **upvalues;
   int upvalue_count;
-} valp_obj_closure;
+};
+
+// Instances with more fields than this, or built from a shape with more
+// than SHAPE_MAX_TRANSITIONS different successors, keep their fields in a
+// hash instead.
+#define SHAPE_MAX_SLOTS 64
+#define SHAPE_MAX_TRANSITIONS 16
+
+// Hidden class describing the field layout of an instance. Instances of a
+// class that add the same fields in the same order end up sharing one
+// shape, starting from the empty root shape owned by the class.
+struct valp_shape {
+  valp_obj obj;
+  valp_shape *parent;
+  valp_string *name;
+  int slot_count;
+  valp_hash slots;
+  valp_hash transitions;
+};
 
 typedef struct {
   valp_obj obj;
   valp_string *name;
   valp_hash methods;
+  valp_shape *shape;
+  int slot_hint;
 } valp_class;
 
 typedef struct {
   valp_obj obj;
   valp_class *klass;
-  valp_hash fields;
+  // NULL once the instance fell back to dictionary mode.
+  valp_shape *shape;
+  valp_hash *fields;
+  // Field values indexed by shape slot. They live in inline_slots until
+  // they outgrow inline_capacity and move to the heap buffer in slots.
+  valp_value *slots;
+  int slot_capacity;
+  int inline_capacity;
+  valp_value inline_slots[];
 } valp_instance;
 
 typedef struct {
@@ -109,15 +198,40 @@ valp_class *new_class(valp_string *name);
 valp_obj_closure *new_closure(valp_function *function);
 valp_function *new_function();
 valp_instance *new_instance(valp_class *klass);
+valp_shape *new_shape(valp_shape *parent, valp_string *name);
+int shape_slot(valp_shape *shape, valp_string *name);
+bool instance_get_field(valp_instance *instance, valp_string *name, valp_value *value);
+void instance_set_field(valp_instance *instance, valp_string *name, valp_value value);
+void instance_append_field(valp_instance *instance, valp_shape *next, valp_value value);
 valp_obj_native *new_native(valp_native_fn function);
-valp_string *take_string(char *chars, int length);
+// An interned string, for identifiers and literals.
 valp_string *copy_string(const char *chars, int length);
+// A string that is not interned, for values made at runtime.
+valp_string *new_string(const char *chars, int length);
+valp_string *concat_strings(valp_string *a, valp_string *b);
+// The interned string with the same characters. Hash keys must be interned.
+valp_string *intern_string(valp_string *string);
+uint32_t string_hash(valp_string *string);
+// For methods that change a string in place. Drops the cached hash of a
+// string made at runtime. Interned strings keep theirs, they may be keys of
+// method, field and shape tables that placed them by it.
+void string_changed(valp_string *string);
+valp_obj *concat_text(valp_obj *a, valp_obj *b);
+valp_string *flatten_rope(valp_rope *rope);
+// Flattens the ropes it compares, a and b have to be reachable.
+bool text_equal(valp_obj *a, valp_obj *b);
 valp_obj_upvalue *new_upvalue(valp_value *slot);
 valp_array *new_array();
+valp_string_builder *new_string_builder();
+// value has to be reachable, see print_value().
 void print_object(valp_value value);
 
 static inline bool is_obj_type(valp_value value, valp_obj_type type) {
   return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+static inline valp_value *instance_slots(valp_instance *instance) {
+  return instance->slots != NULL ? instance->slots : instance->inline_slots;
+}
+
 #endif
\ No newline at end of file
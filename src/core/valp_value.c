@@ -83,15 +83,24 @@ bool array_equal(valp_value a, valp_value b) {
 }
 
 bool string_equal(valp_value a, valp_value b) {
-  char *str = AS_CSTRING(a);
-  char *str2 = AS_CSTRING(b);
-  int result = strcmp(str, str2);
+  valp_string *str = AS_STRING(a);
+  valp_string *str2 = AS_STRING(b);
 
-  return result == 0 ? true : false;
+  if (str == str2) return true;
+  if (str->length != str2->length) return false;
+  if (!str->changed && !str2->changed && string_hash(str) != string_hash(str2)) {
+    return false;
+  }
+
+  return memcmp(str->chars, str2->chars, str->length) == 0;
 }
 
 bool objects_equal(valp_value a, valp_value b) {
   if (IS_OBJ(a) && IS_OBJ(b)) {
+    if (IS_ROPE(a) || IS_ROPE(b)) {
+      return IS_TEXT(a) && IS_TEXT(b) && text_equal(AS_OBJ(a), AS_OBJ(b));
+    }
+
     if (AS_OBJ(a)->type != AS_OBJ(b)->type) { return false; }
 
     switch (AS_OBJ(a)->type) {
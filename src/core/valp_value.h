@@ -8,6 +8,8 @@
 typedef struct valp_obj valp_obj;
 typedef struct valp_string valp_string;
 typedef struct valp_array valp_array;
+typedef struct valp_shape valp_shape;
+typedef struct valp_obj_closure valp_obj_closure;
 
 #ifdef NAN_BOXING
 
@@ -91,6 +93,8 @@ typedef struct {
   valp_value *values;
 } valp_value_array;
 
+// Comparing and printing flatten ropes, which allocates. The values have
+// to be reachable.
 bool values_equal(valp_value a, valp_value b);
 void init_valp_value_array(valp_value_array *array);
 void write_valp_value_array(valp_value_array *array, valp_value value);
@@ -10,15 +10,24 @@
 #include "valp_memory.h"
 #include "valp_native.h"
 
+#ifdef JIT
+#include "valp_jit.h"
+#endif
+
 #include "types/array.h"
 #include "types/string.h"
+#include "types/string_builder.h"
 
 VM vm;
 
+// Frames a stack trace shows at the innermost and the outermost end.
+#define TRACE_EDGE_FRAMES 10
+
 static void reset_stack() {
   vm.stack_top = vm.stack;
   vm.frame_count = 0;
   vm.open_upvalues = NULL;
+  vm.heap_exhausted = false;
 }
 
 void runtime_error(const char *format, ...) {
@@ -28,7 +37,13 @@ void runtime_error(const char *format, ...) {
   va_end(args);
   fputs("\n", stderr);
 
+  // A runaway recursion only shows the frames at either end.
   for (int i = vm.frame_count - 1; i >= 0; i--) {
+    if (i == vm.frame_count - TRACE_EDGE_FRAMES - 1 && i >= TRACE_EDGE_FRAMES) {
+      fprintf(stderr, "... %d more frames\n", i - TRACE_EDGE_FRAMES + 1);
+      i = TRACE_EDGE_FRAMES - 1;
+    }
+
     valp_call_frame* frame = &vm.frames[i];
     valp_function* function = frame->closure->function;
     // -1 because the IP is sitting on the next instruction to be
@@ -47,35 +62,73 @@ void runtime_error(const char *format, ...) {
 }
 
 void init_vm() {
+  vm.frames = NULL;
+  vm.stack = NULL;
   reset_stack();
   vm.objects = NULL;
+  vm.young = NULL;
+  vm.young_bytes = 0;
+  vm.collecting_young = false;
+  vm.remembered_count = 0;
+  vm.remembered_capacity = 0;
+  vm.remembered = NULL;
+  vm.gc_phase = GC_IDLE;
+  vm.scanning = NULL;
+  vm.scanned = 0;
+  vm.sweeping = NULL;
+  vm.gc_before = 0;
   vm.bytes_allocated = 0;
-  vm.next_gc = 1024 * 1024;
+  vm.heap_exhausted = false;
+  vm.compact_pending = false;
+  memset(&vm.gc_stats, 0, sizeof(vm.gc_stats));
+  gc_default_config(&vm.gc);
+  configure_gc(&vm.gc);
 
   vm.gray_count = 0;
   vm.gray_capacity = 0;
   vm.gray_stack = NULL;
 
-  init_hash(&vm.globals);
+#ifdef JIT
+  vm.jit_depth = 0;
+#endif
+
+  init_hash(&vm.global_slots);
+  init_valp_value_array(&vm.globals);
+  init_valp_value_array(&vm.global_names);
   init_hash(&vm.constants);
   init_hash(&vm.strings);
   init_hash(&vm.array_methods);
   init_hash(&vm.string_methods);
+  init_hash(&vm.string_builder_methods);
 
   vm.init_string = NULL;
+
+  vm.frame_max = FRAMES_MAX;
+  vm.stack_max = STACK_MAX;
+  vm.frame_capacity = FRAMES_INITIAL;
+  vm.frames = ALLOCATE(valp_call_frame, vm.frame_capacity);
+  vm.stack_capacity = STACK_INITIAL;
+  vm.stack = ALLOCATE(valp_value, vm.stack_capacity);
+  reset_stack();
+
   vm.init_string = copy_string("init", 4);
 
   define_natives();
   define_array_methods();
   define_string_methods();
+  define_string_builder_methods();
 }
 
 void free_vm() {
-  free_hash(&vm.globals);
+  free_hash(&vm.global_slots);
+  free_valp_value_array(&vm.globals);
+  free_valp_value_array(&vm.global_names);
   free_hash(&vm.constants);
   free_hash(&vm.strings);
   vm.init_string = NULL;
   free_objects();
+  FREE_ARRAY(valp_call_frame, vm.frames, vm.frame_capacity);
+  FREE_ARRAY(valp_value, vm.stack, vm.stack_capacity);
 }
 
 void push(valp_value value) {
@@ -88,29 +141,118 @@ valp_value pop() {
   return *vm.stack_top;
 }
 
+// Returns the slot of the global called name, reserving an undefined one
+// the first time the name is seen. name has to be reachable by the GC.
+int global_slot(valp_string *name) {
+  valp_value slot;
+  if (hash_get(&vm.global_slots, name, &slot)) return (int)AS_NUMBER(slot);
+
+  int index = vm.globals.count;
+  write_valp_value_array(&vm.global_names, OBJ_VAL(name));
+  write_valp_value_array(&vm.globals, UNDEFINED_VAL);
+  hash_set(&vm.global_slots, name, NUMBER_VAL((double)index));
+  return index;
+}
+
 static valp_value peek(int distance) {
   return vm.stack_top[-1 - distance];
 }
 
+// Makes room for count more values above stack_top. When the stack moves,
+// every pointer into it (frame slots, stack_top and the locations of open
+// upvalues) is rebased onto the new block.
+static bool ensure_stack(int count) {
+  int used = (int)(vm.stack_top - vm.stack);
+  if (used + count <= vm.stack_capacity) return true;
+
+  if (used + count > vm.stack_max) {
+    runtime_error("Stack overflow.");
+    return false;
+  }
+
+  int capacity = vm.stack_capacity;
+  while (capacity < used + count) capacity = GROW_CAPACITY(capacity);
+  if (capacity > vm.stack_max) capacity = vm.stack_max;
+
+  // The old block stays valid until the values are copied, so a collection
+  // started by the allocation still sees the whole stack.
+  valp_value *stack = ALLOCATE(valp_value, capacity);
+  memcpy(stack, vm.stack, sizeof(valp_value) * used);
+
+  for (int i = 0; i < vm.frame_count; i++) {
+    vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+  }
+
+  for (valp_obj_upvalue *upvalue = vm.open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
+    upvalue->location = stack + (upvalue->location - vm.stack);
+  }
+
+  FREE_ARRAY(valp_value, vm.stack, vm.stack_capacity);
+  vm.stack = stack;
+  vm.stack_top = stack + used;
+  vm.stack_capacity = capacity;
+  return true;
+}
+
+#ifdef JIT
+static bool jit_execute(int frame) {
+  valp_jit_fn code = (valp_jit_fn)vm.frames[frame].closure->function->jit_code;
+
+  vm.jit_depth++;
+  int status = code(frame);
+  vm.jit_depth--;
+
+  return status == 0;
+}
+#endif
+
 static bool call(valp_obj_closure *closure, int arg_count) {
+  if (vm.heap_exhausted) {
+    runtime_error("Out of memory.");
+    return false;
+  }
+
   if (arg_count != closure->function->arity) {
     runtime_error("Expected %d arguments byt got %d.", closure->function->arity, arg_count);
     return false;
   }
 
-  if (vm.frame_count == FRAMES_MAX) {
+  if (vm.frame_count >= vm.frame_max) {
     runtime_error("Stack overflow.");
     return false;
   }
 
+  if (vm.frame_count == vm.frame_capacity) {
+    int capacity = GROW_CAPACITY(vm.frame_capacity);
+    if (capacity > vm.frame_max) capacity = vm.frame_max;
+    vm.frames = GROW_ARRAY(valp_call_frame, vm.frames, vm.frame_capacity, capacity);
+    vm.frame_capacity = capacity;
+  }
+
+  // Room for the deepest the frame gets, and for what natives and the VM
+  // push on top while it runs.
+  if (!ensure_stack(closure->function->max_stack + STACK_RESERVE)) return false;
+
   valp_call_frame *frame = &vm.frames[vm.frame_count++];
   frame->closure = closure;
   frame->ip = closure->function->bytecode.code;
 
   frame->slots = vm.stack_top - arg_count - 1;
+
+#ifdef JIT
+  // A compiled function runs to completion right here, so callers find its
+  // frame already popped and the result on the stack. The script itself is
+  // left to run().
+  if (vm.frame_count > 1 && vm.jit_depth < JIT_DEPTH_MAX && jit_prepare(closure->function)) {
+    return jit_execute(vm.frame_count - 1);
+  }
+#endif
+
   return true;
 }
 
+// Natives run in the frame of their caller, whose reserve covers what they
+// push.
 static bool call_native_method(valp_value method, int arg_count) {
   valp_native_fn native = AS_NATIVE(method);
   valp_value result = native(arg_count, vm.stack_top - arg_count - 1);
@@ -176,9 +318,90 @@ static bool invoke_from_class(valp_class *klass, valp_string *name, int arg_coun
   return call(AS_CLOSURE(method), arg_count);
 }
 
-static bool invoke(valp_string *name, int arg_count) {
+static valp_cache_entry *cache_find(valp_inline_cache *cache, valp_shape *shape) {
+  for (int i = 0; i < cache->count; i++) {
+    if (cache->entries[i].shape == shape) return &cache->entries[i];
+  }
+
+  return NULL;
+}
+
+// Returns a cleared entry for shape, or NULL once the site has gone
+// megamorphic.
+static valp_cache_entry *cache_add(valp_function *function, valp_inline_cache *cache, valp_shape *shape) {
+  if (cache->count == INLINE_CACHE_MEGAMORPHIC) return NULL;
+  if (cache->count == INLINE_CACHE_SIZE) {
+    cache->count = INLINE_CACHE_MEGAMORPHIC;
+    return NULL;
+  }
+
+  valp_cache_entry *entry = &cache->entries[cache->count++];
+  entry->shape = shape;
+  entry->next_shape = NULL;
+  entry->slot = -1;
+  entry->method = NULL;
+  WRITE_BARRIER(function, OBJ_VAL(shape));
+  return entry;
+}
+
+// Finds what name resolves to on instance, filling the cache on a miss.
+// Returns NULL for dictionary mode instances, megamorphic sites and names
+// that are neither a field nor a method.
+static valp_cache_entry *cache_lookup(valp_function *function, valp_inline_cache *cache, valp_instance *instance, valp_string *name) {
+  if (instance->shape == NULL) return NULL;
+
+  valp_cache_entry *entry = cache_find(cache, instance->shape);
+  if (entry != NULL) return entry;
+
+  int slot = shape_slot(instance->shape, name);
+  valp_value method;
+  if (slot == -1 && !hash_get(&instance->klass->methods, name, &method)) return NULL;
+
+  entry = cache_add(function, cache, instance->shape);
+  if (entry == NULL) return NULL;
+
+  entry->slot = slot;
+  if (slot == -1) {
+    entry->method = AS_CLOSURE(method);
+    WRITE_BARRIER(function, method);
+  }
+  return entry;
+}
+
+// Remembers how a store of a field went for the shape the instance had
+// before it, so the next store on that shape can skip the lookups.
+static void cache_store(valp_function *function, valp_inline_cache *cache, valp_instance *instance, valp_shape *before, valp_string *name) {
+  if (before == NULL || instance->shape == NULL) return;
+  if (cache_find(cache, before) != NULL) return;
+
+  valp_cache_entry *entry = cache_add(function, cache, before);
+  if (entry == NULL) return;
+
+  if (instance->shape == before) {
+    entry->slot = shape_slot(before, name);
+  } else {
+    entry->next_shape = instance->shape;
+    WRITE_BARRIER(function, OBJ_VAL(entry->next_shape));
+    entry->slot = instance->shape->slot_count - 1;
+  }
+}
+
+static bool invoke(valp_function *function, valp_string *name, int arg_count, valp_inline_cache *cache) {
   valp_value receiver = peek(arg_count);
 
+  if (IS_INSTANCE(receiver)) {
+    valp_instance *instance = AS_INSTANCE(receiver);
+    valp_cache_entry *entry = cache_lookup(function, cache, instance, name);
+
+    if (entry != NULL) {
+      if (entry->slot == -1) return call(entry->method, arg_count);
+
+      valp_value value = instance_slots(instance)[entry->slot];
+      vm.stack_top[-arg_count - 1] = value;
+      return call_value(value, arg_count);
+    }
+  }
+
   if (IS_ARRAY(receiver)) {
     valp_value value;
 
@@ -188,15 +411,29 @@ static bool invoke(valp_string *name, int arg_count) {
 
     runtime_error("Undefined method '%s' for Array.", name->chars);
     return false;
-  } else if (IS_STRING(receiver)) {
+  } else if (IS_TEXT(receiver)) {
     valp_value value;
 
+    // String methods take flat strings, as receiver and as arguments.
+    for (valp_value *slot = vm.stack_top - arg_count - 1; slot < vm.stack_top; slot++) {
+      if (IS_ROPE(*slot)) *slot = OBJ_VAL(flatten_rope(AS_ROPE(*slot)));
+    }
+
     if (hash_get(&vm.string_methods, name, &value)) {
       return call_native_method(value, arg_count);
     }
 
     runtime_error("Undefined method '%s' for String.", name->chars);
     return false;
+  } else if (IS_STRING_BUILDER(receiver)) {
+    valp_value value;
+
+    if (hash_get(&vm.string_builder_methods, name, &value)) {
+      return call_native_method(value, arg_count);
+    }
+
+    runtime_error("Undefined method '%s' for StringBuilder.", name->chars);
+    return false;
   }
 
   if (!IS_INSTANCE(receiver)) {
@@ -207,7 +444,7 @@ static bool invoke(valp_string *name, int arg_count) {
   valp_instance *instance = AS_INSTANCE(receiver);
 
   valp_value value;
-  if (hash_get(&instance->fields, name, &value)) {
+  if (instance_get_field(instance, name, &value)) {
     vm.stack_top[-arg_count - 1] = value;
     return call_value(value, arg_count);
   }
@@ -260,6 +497,7 @@ static void close_upvalues(valp_value *last) {
     valp_obj_upvalue *upvalue = vm.open_upvalues;
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
+    WRITE_BARRIER(upvalue, upvalue->closed);
     vm.open_upvalues = upvalue->next;
   }
 }
@@ -276,41 +514,14 @@ bool is_falsey(valp_value value) {
 }
 
 static void concatenate() {
-  valp_string *b = AS_STRING(peek(0));
-  valp_string *a = AS_STRING(peek(1));
-
-  int length = a->length + b->length;
-  char *chars = ALLOCATE(char, length + 1);
-  memcpy(chars, a->chars, a->length);
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
-
-  valp_string *result = take_string(chars, length);
+  valp_obj *result = concat_text(AS_OBJ(peek(1)), AS_OBJ(peek(0)));
   pop();
   pop();
   push(OBJ_VAL(result));
 }
 
-static valp_interpret_result run() {
-  valp_call_frame *frame = &vm.frames[vm.frame_count - 1];
-
-#define READ_BYTE() (*frame->ip++)
-#define READ_CONSTANT() (frame->closure->function->bytecode.constants.values[READ_BYTE()])
-#define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-#define BINARY_OP(value_type, op) \
-  do { \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-      runtime_error("Operands must be numbers."); \
-      return INTERPRET_RUNTIME_ERROR; \
-    } \
-    double b = AS_NUMBER(pop()); \
-    double a = AS_NUMBER(pop()); \
-    push(value_type(a op b)); \
-  } while (false)
-
-  for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
+static void trace_execution(valp_call_frame *frame) {
   printf("          ");
   for (valp_value *slot = vm.stack; slot < vm.stack_top; slot++) {
     printf("[ ");
@@ -319,335 +530,979 @@ static valp_interpret_result run() {
   }
   printf("\n");
   disassemble_instruction(&frame->closure->function->bytecode, (int)(frame->ip - frame->closure->function->bytecode.code));
+}
 #endif
 
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
-      case OP_CONSTANT: {
-        valp_value constant = READ_CONSTANT();
-        push(constant);
-        break;
-      }
-      case OP_NIL:       push(NIL_VAL); break;
-      case OP_TRUE:      push(BOOL_VAL(true)); break;
-      case OP_FALSE:     push(BOOL_VAL(false)); break;
-      case OP_POP:       pop(); break;
-      case OP_GET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        push(frame->slots[slot]);
-        break;
-      }
-      case OP_SET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        frame->slots[slot] = peek(0);
-        break;
-      }
-      case OP_GET_GLOBAL: {
-        valp_string *name = READ_STRING();
-        valp_value value;
-        if (!hash_get(&vm.globals, name, &value)) {
-          runtime_error("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        push(value);
-        break;
-      }
-      case OP_DEFINE_GLOBAL: {
-        valp_string *name = READ_STRING();
-        hash_set(&vm.globals, name, peek(0));
-        pop();
-        break;
-      }
-      case OP_SET_GLOBAL: {
-        valp_string *name = READ_STRING();
-        if (hash_set(&vm.globals, name, peek(0))) {
-          hash_delete(&vm.globals, name);
-          runtime_error("Undefined variable '%s'.", name->chars);
-          return INTERPRET_COMPILE_ERROR;
-        }
-        break;
-      }
-      case OP_GET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        push(*frame->closure->upvalues[slot]->location);
-        break;
-      }
-      case OP_SET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        *frame->closure->upvalues[slot]->location = peek(0);
-        break;
-      }
-      case OP_GET_PROPERTY: {
-        if (!IS_INSTANCE(peek(0))) {
-          runtime_error("Only instances have properties.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-
-        valp_instance *instance = AS_INSTANCE(peek(0));
-        valp_string *name = READ_STRING();
-
-        valp_value value;
-        if (hash_get(&instance->fields, name, &value)) {
-          pop();
-          push(value);
-          break;
-        }
+// Runs the frames from the top one down until the frame at index
+// base_frame returns. Compiled code uses this for callees it cannot run
+// itself, interpret() with 0 for the whole script.
+static valp_interpret_result run(int base_frame) {
+  // The hot state lives in locals so the compiler can keep it in
+  // registers. It is written back with STORE_FRAME() before anything that
+  // may read it from vm/frame (calls, allocations that can start a GC,
+  // runtime_error) and picked up again with LOAD_FRAME() afterwards.
+  valp_call_frame *frame;
+  uint8_t *ip;
+  valp_value *slots;
+  valp_value *constants;
+  valp_value *sp;
+
+#define STORE_FRAME() (frame->ip = ip, vm.stack_top = sp)
+#define LOAD_FRAME() \
+  do { \
+    frame = &vm.frames[vm.frame_count - 1]; \
+    ip = frame->ip; \
+    slots = frame->slots; \
+    constants = frame->closure->function->bytecode.constants.values; \
+    sp = vm.stack_top; \
+  } while (false)
 
-        if (!bind_method(instance->klass, name)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define DROP() (sp--)
+#define PEEK(distance) (sp[-1 - (distance)])
 
-        break;
-      }
-      case OP_GET_PROPERTY_NO_POP: {
-        if (!IS_INSTANCE(peek(0))) {
-          runtime_error("Only instances have properties.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-
-        valp_instance *instance = AS_INSTANCE(peek(0));
-        valp_string *name = READ_STRING();
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_CACHE() (&frame->closure->function->bytecode.caches[READ_SHORT()])
+#define RUNTIME_ERROR(...) \
+  do { \
+    STORE_FRAME(); \
+    runtime_error(__VA_ARGS__); \
+    return INTERPRET_RUNTIME_ERROR; \
+  } while (false)
+#define BINARY_OP(value_type, op, quickened) \
+  do { \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+      RUNTIME_ERROR("Operands must be numbers."); \
+    } \
+    ip[-1] = quickened; \
+    double b = AS_NUMBER(POP()); \
+    double a = AS_NUMBER(POP()); \
+    PUSH(value_type(a op b)); \
+  } while (false)
+// a >= b and a <= b are !(a < b) and !(a > b), as they were when the
+// compiler emitted them as two instructions. That keeps them true for NaN.
+#define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
+// Put the generic instruction back and run it again.
+#define DEQUICKEN(generic) \
+  do { \
+    ip[-1] = generic; \
+    ip--; \
+    DISPATCH(); \
+  } while (false)
+#define NUMBER_OP(value_type, op, generic) \
+  do { \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+      DEQUICKEN(generic); \
+    } \
+    double b = AS_NUMBER(POP()); \
+    double a = AS_NUMBER(POP()); \
+    PUSH(value_type(a op b)); \
+  } while (false)
 
-        valp_value value;
-        if (hash_get(&instance->fields, name, &value)) {
-          push(value);
-          break;
-        }
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_EXECUTION() (STORE_FRAME(), trace_execution(frame))
+#else
+#define TRACE_EXECUTION() do { } while (false)
+#endif
 
-        if (!bind_method(instance->klass, name)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
+// Objects may move only where no C code holds pointers to them. Natives
+// and the compiler never run the interpreter loop, but compiled code calls
+// back into it.
+#ifdef JIT
+#define AT_SAFE_POINT() (vm.jit_depth == 0)
+#else
+#define AT_SAFE_POINT() true
+#endif
 
-        break;
-      }
-      case OP_SET_PROPERTY: {
-        if (!IS_INSTANCE(peek(1))) {
-          runtime_error("Only instances have fields.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
+// With COMPUTED_GOTO every handler jumps straight to the next one through
+// dispatch_table, so each opcode gets its own indirect branch instead of
+// sharing the one at the top of the switch.
+#ifdef COMPUTED_GOTO
+  static void *dispatch_table[] = {
+    [OP_CONSTANT]         = &&label_OP_CONSTANT,
+    [OP_NIL]              = &&label_OP_NIL,
+    [OP_TRUE]             = &&label_OP_TRUE,
+    [OP_FALSE]            = &&label_OP_FALSE,
+    [OP_POP]              = &&label_OP_POP,
+    [OP_GET_LOCAL]        = &&label_OP_GET_LOCAL,
+    [OP_SET_LOCAL]        = &&label_OP_SET_LOCAL,
+    [OP_GET_GLOBAL_SLOT]  = &&label_OP_GET_GLOBAL_SLOT,
+    [OP_DEFINE_GLOBAL_SLOT] = &&label_OP_DEFINE_GLOBAL_SLOT,
+    [OP_SET_GLOBAL_SLOT]  = &&label_OP_SET_GLOBAL_SLOT,
+    [OP_GET_UPVALUE]      = &&label_OP_GET_UPVALUE,
+    [OP_SET_UPVALUE]      = &&label_OP_SET_UPVALUE,
+    [OP_GET_PROPERTY]     = &&label_OP_GET_PROPERTY,
+    [OP_GET_PROPERTY_NO_POP] = &&label_OP_GET_PROPERTY_NO_POP,
+    [OP_SET_PROPERTY]     = &&label_OP_SET_PROPERTY,
+    [OP_GET_SUPER]        = &&label_OP_GET_SUPER,
+    [OP_EQUAL]            = &&label_OP_EQUAL,
+    [OP_GREATER]          = &&label_OP_GREATER,
+    [OP_LESS]             = &&label_OP_LESS,
+    [OP_NOT_EQUAL]        = &&label_OP_NOT_EQUAL,
+    [OP_GREATER_EQUAL]    = &&label_OP_GREATER_EQUAL,
+    [OP_LESS_EQUAL]       = &&label_OP_LESS_EQUAL,
+    [OP_ADD]              = &&label_OP_ADD,
+    [OP_SUBTRACT]         = &&label_OP_SUBTRACT,
+    [OP_MULTIPLY]         = &&label_OP_MULTIPLY,
+    [OP_DIVIDE]           = &&label_OP_DIVIDE,
+    [OP_NOT]              = &&label_OP_NOT,
+    [OP_NEGATE]           = &&label_OP_NEGATE,
+    [OP_PRINT]            = &&label_OP_PRINT,
+    [OP_JUMP]             = &&label_OP_JUMP,
+    [OP_JUMP_IF_FALSE]    = &&label_OP_JUMP_IF_FALSE,
+    [OP_JUMP_COMPARE]     = &&label_OP_JUMP_COMPARE,
+    [OP_LOOP]             = &&label_OP_LOOP,
+    [OP_CALL]             = &&label_OP_CALL,
+    [OP_TAIL_CALL]        = &&label_OP_TAIL_CALL,
+    [OP_INVOKE]           = &&label_OP_INVOKE,
+    [OP_SUPER_INVOKE]     = &&label_OP_SUPER_INVOKE,
+    [OP_CLOSURE]          = &&label_OP_CLOSURE,
+    [OP_CLOSE_UPVALUE]    = &&label_OP_CLOSE_UPVALUE,
+    [OP_RETURN]           = &&label_OP_RETURN,
+    [OP_CLASS]            = &&label_OP_CLASS,
+    [OP_INHERIT]          = &&label_OP_INHERIT,
+    [OP_METHOD]           = &&label_OP_METHOD,
+    [OP_DUP]              = &&label_OP_DUP,
+    [OP_NEW_ARRAY]        = &&label_OP_NEW_ARRAY,
+    [OP_SLICE]            = &&label_OP_SLICE,
+    [OP_BREAK]            = &&label_OP_BREAK,
+    [OP_ADD_NUM]          = &&label_OP_ADD_NUM,
+    [OP_ADD_STR]          = &&label_OP_ADD_STR,
+    [OP_SUBTRACT_NUM]     = &&label_OP_SUBTRACT_NUM,
+    [OP_MULTIPLY_NUM]     = &&label_OP_MULTIPLY_NUM,
+    [OP_DIVIDE_NUM]       = &&label_OP_DIVIDE_NUM,
+    [OP_GREATER_NUM]      = &&label_OP_GREATER_NUM,
+    [OP_LESS_NUM]         = &&label_OP_LESS_NUM,
+    [OP_GREATER_EQUAL_NUM] = &&label_OP_GREATER_EQUAL_NUM,
+    [OP_LESS_EQUAL_NUM]   = &&label_OP_LESS_EQUAL_NUM,
+  };
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(op) label_##op
+#define DISPATCH() \
+  do { \
+    TRACE_EXECUTION(); \
+    goto *dispatch_table[instruction = READ_BYTE()]; \
+  } while (false)
+#else
+#define INTERPRET_LOOP \
+  loop: \
+    TRACE_EXECUTION(); \
+    switch (instruction = READ_BYTE())
+#define CASE(op) case op
+#define DISPATCH() goto loop
+#endif
 
-        valp_instance *instance = AS_INSTANCE(peek(1));
-        hash_set(&instance->fields, READ_STRING(), peek(0));
+  LOAD_FRAME();
 
-        valp_value value = pop();
-        pop();
-        push(value);
-        break;
+  uint8_t instruction;
+  INTERPRET_LOOP {
+    CASE(OP_CONSTANT): {
+      valp_value constant = READ_CONSTANT();
+      PUSH(constant);
+      DISPATCH();
+    }
+    CASE(OP_NIL):       PUSH(NIL_VAL); DISPATCH();
+    CASE(OP_TRUE):      PUSH(BOOL_VAL(true)); DISPATCH();
+    CASE(OP_FALSE):     PUSH(BOOL_VAL(false)); DISPATCH();
+    CASE(OP_POP):       DROP(); DISPATCH();
+    CASE(OP_GET_LOCAL): {
+      uint8_t slot = READ_BYTE();
+      PUSH(slots[slot]);
+      DISPATCH();
+    }
+    CASE(OP_SET_LOCAL): {
+      uint8_t slot = READ_BYTE();
+      slots[slot] = PEEK(0);
+      DISPATCH();
+    }
+    CASE(OP_GET_GLOBAL_SLOT): {
+      uint16_t slot = READ_SHORT();
+      valp_value value = vm.globals.values[slot];
+      if (IS_UNDEFINED(value)) {
+        RUNTIME_ERROR("Undefined variable '%s'.", AS_STRING(vm.global_names.values[slot])->chars);
       }
-      case OP_GET_SUPER: {
-        valp_string *name = READ_STRING();
-        valp_class *superclass = AS_CLASS(pop());
-        if (!bind_method(superclass, name)) { return INTERPRET_RUNTIME_ERROR; }
-
-        break;
+      PUSH(value);
+      DISPATCH();
+    }
+    CASE(OP_DEFINE_GLOBAL_SLOT): {
+      vm.globals.values[READ_SHORT()] = PEEK(0);
+      DROP();
+      DISPATCH();
+    }
+    CASE(OP_SET_GLOBAL_SLOT): {
+      uint16_t slot = READ_SHORT();
+      if (IS_UNDEFINED(vm.globals.values[slot])) {
+        RUNTIME_ERROR("Undefined variable '%s'.", AS_STRING(vm.global_names.values[slot])->chars);
       }
-      case OP_EQUAL: {
-        valp_value b = pop();
-        valp_value a = pop();
-        push(BOOL_VAL(values_equal(a, b)));
-        break;
+      vm.globals.values[slot] = PEEK(0);
+      DISPATCH();
+    }
+    CASE(OP_GET_UPVALUE): {
+      uint8_t slot = READ_BYTE();
+      PUSH(*frame->closure->upvalues[slot]->location);
+      DISPATCH();
+    }
+    CASE(OP_SET_UPVALUE): {
+      valp_obj_upvalue *upvalue = frame->closure->upvalues[READ_BYTE()];
+      *upvalue->location = PEEK(0);
+      WRITE_BARRIER(upvalue, PEEK(0));
+      DISPATCH();
+    }
+    CASE(OP_GET_PROPERTY): {
+      if (!IS_INSTANCE(PEEK(0))) {
+        RUNTIME_ERROR("Only instances have properties.");
       }
-      case OP_GREATER:   BINARY_OP(BOOL_VAL, >); break;
-      case OP_LESS:      BINARY_OP(BOOL_VAL, <); break;
-      case OP_ADD: {
-        if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-          concatenate();
-        } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-          double b = AS_NUMBER(pop());
-          double a = AS_NUMBER(pop());
-          push(NUMBER_VAL(a + b));
+
+      valp_instance *instance = AS_INSTANCE(PEEK(0));
+      valp_string *name = READ_STRING();
+      valp_cache_entry *entry = cache_lookup(frame->closure->function, READ_CACHE(), instance, name);
+
+      if (entry != NULL) {
+        if (entry->slot != -1) {
+          PEEK(0) = instance_slots(instance)[entry->slot];
         } else {
-          runtime_error("Operands must be two numbers or two strings.");
-          return INTERPRET_RUNTIME_ERROR;
+          STORE_FRAME();
+          PEEK(0) = OBJ_VAL(new_bound_method(PEEK(0), entry->method));
         }
-        break;
+        DISPATCH();
       }
-      case OP_SUBTRACT:  BINARY_OP(NUMBER_VAL, -); break;
-      case OP_MULTIPLY:  BINARY_OP(NUMBER_VAL, *); break;
-      case OP_DIVIDE:    BINARY_OP(NUMBER_VAL, /); break;
-      case OP_NOT:       push(BOOL_VAL(is_falsey(pop()))); break;
-      case OP_NEGATE:
-        if(!IS_NUMBER(peek(0))) {
-          runtime_error("Operand must be a number.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
 
-        push(NUMBER_VAL(-AS_NUMBER(pop())));
-        break;
-      case OP_PRINT: {
-        print_value(pop());
-        printf("\n");
-        break;
+      valp_value value;
+      if (instance_get_field(instance, name, &value)) {
+        DROP();
+        PUSH(value);
+        DISPATCH();
       }
-      case OP_JUMP: {
-        uint16_t offset = READ_SHORT();
-        frame->ip += offset;
-        break;
+
+      STORE_FRAME();
+      if (!bind_method(instance->klass, name)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_JUMP_IF_FALSE: {
-        uint16_t offset = READ_SHORT();
-        if (is_falsey(peek(0))) frame->ip += offset;
-        break;
+      sp = vm.stack_top;
+
+      DISPATCH();
+    }
+    CASE(OP_GET_PROPERTY_NO_POP): {
+      if (!IS_INSTANCE(PEEK(0))) {
+        RUNTIME_ERROR("Only instances have properties.");
       }
-      case OP_JUMP_COMPARE: {
-        uint16_t offset = READ_SHORT();
-        valp_value a = pop();
-        valp_value b = peek(0);
 
-        if (values_equal(a, b)) {
-          pop();
+      valp_instance *instance = AS_INSTANCE(PEEK(0));
+      valp_string *name = READ_STRING();
+      valp_cache_entry *entry = cache_lookup(frame->closure->function, READ_CACHE(), instance, name);
+
+      if (entry != NULL) {
+        if (entry->slot != -1) {
+          PUSH(instance_slots(instance)[entry->slot]);
         } else {
-          frame->ip += offset;
+          STORE_FRAME();
+          valp_bound_method *bound = new_bound_method(PEEK(0), entry->method);
+          PUSH(OBJ_VAL(bound));
         }
+        DISPATCH();
+      }
 
-        break;
+      valp_value value;
+      if (instance_get_field(instance, name, &value)) {
+        PUSH(value);
+        DISPATCH();
       }
-      case OP_LOOP: {
-        uint16_t offset = READ_SHORT();
-        frame->ip -= offset;
-        break;
+
+      STORE_FRAME();
+      if (!bind_method(instance->klass, name)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_CALL: {
-        int arg_count = READ_BYTE();
-        if (!call_value(peek(arg_count), arg_count)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        frame = &vm.frames[vm.frame_count - 1];
-        break;
+      sp = vm.stack_top;
+
+      DISPATCH();
+    }
+    CASE(OP_SET_PROPERTY): {
+      if (!IS_INSTANCE(PEEK(1))) {
+        RUNTIME_ERROR("Only instances have fields.");
       }
-      case OP_INVOKE: {
-        valp_string *method = READ_STRING();
-        int arg_count = READ_BYTE();
-        if (!invoke(method, arg_count)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
 
-        frame = &vm.frames[vm.frame_count - 1];
-        break;
+      valp_instance *instance = AS_INSTANCE(PEEK(1));
+      valp_string *name = READ_STRING();
+      valp_inline_cache *cache = READ_CACHE();
+      valp_shape *before = instance->shape;
+      valp_cache_entry *entry = before != NULL ? cache_find(cache, before) : NULL;
+
+      STORE_FRAME();
+      if (entry == NULL) {
+        instance_set_field(instance, name, PEEK(0));
+        cache_store(frame->closure->function, cache, instance, before, name);
+      } else if (entry->next_shape == NULL) {
+        instance_slots(instance)[entry->slot] = PEEK(0);
+        WRITE_BARRIER(instance, PEEK(0));
+      } else {
+        instance_append_field(instance, entry->next_shape, PEEK(0));
       }
-      case OP_SUPER_INVOKE: {
-        valp_string *method = READ_STRING();
-        int arg_count = READ_BYTE();
-        valp_class *superclass = AS_CLASS(pop());
-        if (!invoke_from_class(superclass, method, arg_count)) {
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        frame = &vm.frames[vm.frame_count - 1];
-        break;
+
+      valp_value value = POP();
+      DROP();
+      PUSH(value);
+      DISPATCH();
+    }
+    CASE(OP_GET_SUPER): {
+      valp_string *name = READ_STRING();
+      valp_class *superclass = AS_CLASS(POP());
+
+      STORE_FRAME();
+      if (!bind_method(superclass, name)) { return INTERPRET_RUNTIME_ERROR; }
+      sp = vm.stack_top;
+
+      DISPATCH();
+    }
+    CASE(OP_EQUAL): {
+      // The operands stay on the stack while ropes among them get flattened.
+      STORE_FRAME();
+      bool equal = values_equal(PEEK(1), PEEK(0));
+      DROP();
+      DROP();
+      PUSH(BOOL_VAL(equal));
+      DISPATCH();
+    }
+    CASE(OP_GREATER):   BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM); DISPATCH();
+    CASE(OP_LESS):      BINARY_OP(BOOL_VAL, <, OP_LESS_NUM); DISPATCH();
+    CASE(OP_NOT_EQUAL): {
+      STORE_FRAME();
+      bool equal = values_equal(PEEK(1), PEEK(0));
+      DROP();
+      DROP();
+      PUSH(BOOL_VAL(!equal));
+      DISPATCH();
+    }
+    CASE(OP_GREATER_EQUAL): BINARY_OP(NOT_BOOL_VAL, <, OP_GREATER_EQUAL_NUM); DISPATCH();
+    CASE(OP_LESS_EQUAL):    BINARY_OP(NOT_BOOL_VAL, >, OP_LESS_EQUAL_NUM); DISPATCH();
+    CASE(OP_ADD): {
+      if (IS_TEXT(PEEK(0)) && IS_TEXT(PEEK(1))) {
+        ip[-1] = OP_ADD_STR;
+        STORE_FRAME();
+        concatenate();
+        sp = vm.stack_top;
+      } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+        ip[-1] = OP_ADD_NUM;
+        double b = AS_NUMBER(POP());
+        double a = AS_NUMBER(POP());
+        PUSH(NUMBER_VAL(a + b));
+      } else {
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
       }
-      case OP_CLOSURE: {
-        valp_function *function = AS_FUNCTION(READ_CONSTANT());
-        valp_obj_closure *closure = new_closure(function);
-        push(OBJ_VAL(closure));
-        for (int i =0; i < closure->upvalue_count; i++) {
-          uint8_t is_local = READ_BYTE();
-          uint8_t index = READ_BYTE();
-          if (is_local) {
-            closure->upvalues[i] = capture_upvalue(frame->slots + index);
-          } else {
-            closure->upvalues[i] = frame->closure->upvalues[index];
-          }
-        }
-        break;
+      DISPATCH();
+    }
+    CASE(OP_SUBTRACT):  BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM); DISPATCH();
+    CASE(OP_MULTIPLY):  BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM); DISPATCH();
+    CASE(OP_DIVIDE):    BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM); DISPATCH();
+    CASE(OP_NOT): {
+      valp_value value = POP();
+      PUSH(BOOL_VAL(is_falsey(value)));
+      DISPATCH();
+    }
+    CASE(OP_NEGATE): {
+      if(!IS_NUMBER(PEEK(0))) {
+        RUNTIME_ERROR("Operand must be a number.");
       }
-      case OP_CLOSE_UPVALUE: {
-        close_upvalues(vm.stack_top - 1);
-        pop();
-        break;
+
+      double value = AS_NUMBER(POP());
+      PUSH(NUMBER_VAL(-value));
+      DISPATCH();
+    }
+    CASE(OP_PRINT): {
+      STORE_FRAME();
+      print_value(PEEK(0));
+      printf("\n");
+      DROP();
+      DISPATCH();
+    }
+    CASE(OP_JUMP): {
+      uint16_t offset = READ_SHORT();
+      ip += offset;
+      DISPATCH();
+    }
+    CASE(OP_JUMP_IF_FALSE): {
+      uint16_t offset = READ_SHORT();
+      if (is_falsey(PEEK(0))) ip += offset;
+      DISPATCH();
+    }
+    CASE(OP_JUMP_COMPARE): {
+      uint16_t offset = READ_SHORT();
+      STORE_FRAME();
+      bool equal = values_equal(PEEK(0), PEEK(1));
+      DROP();
+
+      if (equal) {
+        DROP();
+      } else {
+        ip += offset;
       }
-      case OP_RETURN: {
-        valp_value result = pop();
 
-        close_upvalues(frame->slots);
+      DISPATCH();
+    }
+    CASE(OP_LOOP): {
+      uint16_t offset = READ_SHORT();
+      if (vm.heap_exhausted) RUNTIME_ERROR("Out of memory.");
+      if (vm.compact_pending && AT_SAFE_POINT()) {
+        STORE_FRAME();
+        compact_heap();
+        LOAD_FRAME();
+      }
+      ip -= offset;
+      DISPATCH();
+    }
+    CASE(OP_CALL): {
+      int arg_count = READ_BYTE();
+      STORE_FRAME();
+      if (!call_value(PEEK(arg_count), arg_count)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    CASE(OP_TAIL_CALL): {
+      int arg_count = READ_BYTE();
+      valp_value callee = PEEK(arg_count);
 
-        vm.frame_count--;
-        if (vm.frame_count == 0) {
-          pop();
-          return INTERPRET_OK;
-        }
+      // Only calls that push a frame are worth reusing the current one for,
+      // the rest continue with the OP_RETURN that follows.
+      if (IS_CLOSURE(callee) || IS_BOUND_METHOD(callee)) {
+        close_upvalues(slots);
 
-        vm.stack_top = frame->slots;
-        push(result);
+        memmove(slots, sp - arg_count - 1, sizeof(valp_value) * (arg_count + 1));
+        sp = slots + arg_count + 1;
+        vm.frame_count--;
+      }
 
-        frame = &vm.frames[vm.frame_count - 1];
-        break;
+      STORE_FRAME();
+      if (!call_value(callee, arg_count)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_CLASS: {
-        push(OBJ_VAL(new_class(READ_STRING())));
-        break;
+      // A compiled callee has already returned in place of the base frame.
+      if (vm.frame_count == base_frame) return INTERPRET_OK;
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    CASE(OP_INVOKE): {
+      valp_string *method = READ_STRING();
+      int arg_count = READ_BYTE();
+      valp_inline_cache *cache = READ_CACHE();
+      STORE_FRAME();
+      if (!invoke(frame->closure->function, method, arg_count, cache)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_INHERIT: {
-        valp_value superclass = peek(1);
-        if (!IS_CLASS(superclass)) {
-          runtime_error("Superclass muyst be a class.");
-          return INTERPRET_RUNTIME_ERROR;
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    CASE(OP_SUPER_INVOKE): {
+      valp_string *method = READ_STRING();
+      int arg_count = READ_BYTE();
+      valp_class *superclass = AS_CLASS(POP());
+      STORE_FRAME();
+      if (!invoke_from_class(superclass, method, arg_count)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    CASE(OP_CLOSURE): {
+      valp_function *function = AS_FUNCTION(READ_CONSTANT());
+      STORE_FRAME();
+      valp_obj_closure *closure = new_closure(function);
+      PUSH(OBJ_VAL(closure));
+      vm.stack_top = sp;
+      for (int i =0; i < closure->upvalue_count; i++) {
+        uint8_t is_local = READ_BYTE();
+        uint8_t index = READ_BYTE();
+        if (is_local) {
+          closure->upvalues[i] = capture_upvalue(slots + index);
+        } else {
+          closure->upvalues[i] = frame->closure->upvalues[index];
         }
-        valp_class *subclass = AS_CLASS(peek(0));
-        hash_add_all(&AS_CLASS(superclass)->methods, &subclass->methods);
-        pop();
-        break;
+        WRITE_BARRIER(closure, OBJ_VAL(closure->upvalues[i]));
       }
-      case OP_METHOD: {
-        define_method(READ_STRING());
-        break;
+      DISPATCH();
+    }
+    CASE(OP_CLOSE_UPVALUE): {
+      close_upvalues(sp - 1);
+      DROP();
+      DISPATCH();
+    }
+    CASE(OP_RETURN): {
+      valp_value result = POP();
+
+      close_upvalues(slots);
+
+      vm.frame_count--;
+      if (vm.frame_count == 0) {
+        DROP();
+        vm.stack_top = sp;
+        return INTERPRET_OK;
       }
-      case OP_DUP: { // bruhh xDDD
-        valp_value b = pop();
-        push(b);
-        push(b);
-        break;
+
+      sp = slots;
+      PUSH(result);
+      vm.stack_top = sp;
+      if (vm.frame_count == base_frame) return INTERPRET_OK;
+
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    CASE(OP_CLASS): {
+      valp_string *name = READ_STRING();
+      STORE_FRAME();
+      PUSH(OBJ_VAL(new_class(name)));
+      DISPATCH();
+    }
+    CASE(OP_INHERIT): {
+      valp_value superclass = PEEK(1);
+      if (!IS_CLASS(superclass)) {
+        RUNTIME_ERROR("Superclass muyst be a class.");
       }
-      case OP_BREAK: {
-        break;
+      valp_class *subclass = AS_CLASS(PEEK(0));
+      STORE_FRAME();
+      hash_add_all(&AS_CLASS(superclass)->methods, &subclass->methods);
+      DROP();
+      DISPATCH();
+    }
+    CASE(OP_METHOD): {
+      valp_string *name = READ_STRING();
+      STORE_FRAME();
+      define_method(name);
+      sp = vm.stack_top;
+      DISPATCH();
+    }
+    CASE(OP_DUP): { // bruhh xDDD
+      valp_value b = PEEK(0);
+      PUSH(b);
+      DISPATCH();
+    }
+    CASE(OP_BREAK): {
+      DISPATCH();
+    }
+    CASE(OP_NEW_ARRAY): {
+      int size = READ_BYTE();
+      STORE_FRAME();
+      valp_array *arr = new_array();
+      PUSH(OBJ_VAL(arr));
+      vm.stack_top = sp;
+
+      for (int i = size; i > 0; --i) {
+        write_valp_value_array(&arr->values, PEEK(i));
+        WRITE_BARRIER(arr, PEEK(i));
       }
-      case OP_NEW_ARRAY: {
-        int size = READ_BYTE();
-        valp_array *arr = new_array();
-        push(OBJ_VAL(arr));
-
-        for (int i = size; i > 0; --i) {
-          write_valp_value_array(&arr->values, peek(i));
-        }
 
-        vm.stack_top -= size + 1;
-        push(OBJ_VAL(arr));
-        break;
+      sp -= size + 1;
+      PUSH(OBJ_VAL(arr));
+      DISPATCH();
+    }
+    CASE(OP_SLICE): {
+      if (!IS_NUMBER(PEEK(0))) {
+        RUNTIME_ERROR("Argument must been a number.");
       }
-      case OP_SLICE: {
-        if (!IS_NUMBER(peek(0))) {
-          runtime_error("Argument must been a number.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
 
-        int idx = AS_NUMBER(pop());
+      int idx = AS_NUMBER(POP());
 
-        if (!IS_ARRAY(peek(0))) {
-          runtime_error("Caller must been an array.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
+      if (!IS_ARRAY(PEEK(0))) {
+        RUNTIME_ERROR("Caller must been an array.");
+      }
 
-        valp_array *array = AS_ARRAY(pop());
+      valp_array *array = AS_ARRAY(POP());
 
-        if (idx < 0 || idx > array->values.count - 1) {
-          runtime_error("Index out of bound.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
+      if (idx < 0 || idx > array->values.count - 1) {
+        RUNTIME_ERROR("Index out of bound.");
+      }
 
-        valp_value *elements = array->values.values;
+      valp_value *elements = array->values.values;
 
-        push(elements[idx]);
-        break;
+      PUSH(elements[idx]);
+      DISPATCH();
+    }
+    CASE(OP_ADD_NUM):      NUMBER_OP(NUMBER_VAL, +, OP_ADD); DISPATCH();
+    CASE(OP_SUBTRACT_NUM): NUMBER_OP(NUMBER_VAL, -, OP_SUBTRACT); DISPATCH();
+    CASE(OP_MULTIPLY_NUM): NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY); DISPATCH();
+    CASE(OP_DIVIDE_NUM):   NUMBER_OP(NUMBER_VAL, /, OP_DIVIDE); DISPATCH();
+    CASE(OP_GREATER_NUM):  NUMBER_OP(BOOL_VAL, >, OP_GREATER); DISPATCH();
+    CASE(OP_LESS_NUM):     NUMBER_OP(BOOL_VAL, <, OP_LESS); DISPATCH();
+    CASE(OP_GREATER_EQUAL_NUM): NUMBER_OP(NOT_BOOL_VAL, <, OP_GREATER_EQUAL); DISPATCH();
+    CASE(OP_LESS_EQUAL_NUM):    NUMBER_OP(NOT_BOOL_VAL, >, OP_LESS_EQUAL); DISPATCH();
+    CASE(OP_ADD_STR): {
+      if (!IS_TEXT(PEEK(0)) || !IS_TEXT(PEEK(1))) {
+        DEQUICKEN(OP_ADD);
       }
+
+      STORE_FRAME();
+      concatenate();
+      sp = vm.stack_top;
+      DISPATCH();
     }
   }
 
+  // Only reached for a byte that is not a valid opcode.
+  RUNTIME_ERROR("Unknown opcode %d.", instruction);
+
+#undef DISPATCH
+#undef CASE
+#undef INTERPRET_LOOP
+#undef TRACE_EXECUTION
+#undef AT_SAFE_POINT
+#undef NUMBER_OP
+#undef DEQUICKEN
 #undef BINARY_OP
+#undef NOT_BOOL_VAL
+#undef RUNTIME_ERROR
 #undef READ_STRING
+#undef READ_CACHE
 #undef READ_SHORT
 #undef READ_CONSTANT
 #undef READ_BYTE
+#undef PEEK
+#undef DROP
+#undef POP
+#undef PUSH
+#undef LOAD_FRAME
+#undef STORE_FRAME
+}
+
+#ifdef JIT
+// Entry points for compiled code, declared in valp_jit.h. Each one does
+// what the matching instruction does in run(), on vm.stack_top.
+
+static valp_function *jit_function(int frame, uint8_t *ip) {
+  vm.frames[frame].ip = ip;
+  return vm.frames[frame].closure->function;
+}
+
+#define JIT_STRING(function, constant) AS_STRING((function)->bytecode.constants.values[constant])
+#define JIT_ERROR(...) \
+  do { \
+    runtime_error(__VA_ARGS__); \
+    return 1; \
+  } while (false)
+
+// Finishes a call started with the frame count at base. Compiled and native
+// callees are done already, interpreted ones run until they return.
+static int jit_finish_call(int base) {
+  if (vm.frame_count == base) return 0;
+  return run(base) == INTERPRET_OK ? 0 : 1;
+}
+
+int jit_binary(int frame, uint8_t *ip, int op, int unused) {
+  (void)unused;
+  jit_function(frame, ip);
+
+  if (op == OP_ADD && IS_TEXT(peek(0)) && IS_TEXT(peek(1))) {
+    concatenate();
+    return 0;
+  }
+
+  if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+    if (op == OP_ADD) JIT_ERROR("Operands must be two numbers or two strings.");
+    JIT_ERROR("Operands must be numbers.");
+  }
+
+  double b = AS_NUMBER(pop());
+  double a = AS_NUMBER(pop());
+
+  switch (op) {
+    case OP_ADD:           push(NUMBER_VAL(a + b)); break;
+    case OP_SUBTRACT:      push(NUMBER_VAL(a - b)); break;
+    case OP_MULTIPLY:      push(NUMBER_VAL(a * b)); break;
+    case OP_DIVIDE:        push(NUMBER_VAL(a / b)); break;
+    case OP_GREATER:       push(BOOL_VAL(a > b)); break;
+    case OP_LESS:          push(BOOL_VAL(a < b)); break;
+    case OP_GREATER_EQUAL: push(BOOL_VAL(!(a < b))); break;
+    case OP_LESS_EQUAL:    push(BOOL_VAL(!(a > b))); break;
+  }
+
+  return 0;
+}
+
+int jit_equal(int frame, uint8_t *ip, int negate, int unused) {
+  (void)unused;
+  jit_function(frame, ip);
+
+  bool equal = values_equal(peek(1), peek(0));
+  pop();
+  pop();
+  push(BOOL_VAL(equal != (bool)negate));
+  return 0;
+}
+
+int jit_not(int frame, uint8_t *ip, int unused, int unused2) {
+  (void)unused;
+  (void)unused2;
+  jit_function(frame, ip);
+
+  valp_value value = pop();
+  push(BOOL_VAL(is_falsey(value)));
+  return 0;
+}
+
+int jit_negate(int frame, uint8_t *ip, int unused, int unused2) {
+  (void)unused;
+  (void)unused2;
+  jit_function(frame, ip);
+
+  if (!IS_NUMBER(peek(0))) JIT_ERROR("Operand must be a number.");
+
+  double value = AS_NUMBER(pop());
+  push(NUMBER_VAL(-value));
+  return 0;
+}
+
+int jit_print(int frame, uint8_t *ip, int unused, int unused2) {
+  (void)unused;
+  (void)unused2;
+  jit_function(frame, ip);
+
+  print_value(peek(0));
+  printf("\n");
+  pop();
+  return 0;
 }
 
+int jit_undefined_global(int frame, uint8_t *ip, int slot, int unused) {
+  (void)unused;
+  jit_function(frame, ip);
+
+  JIT_ERROR("Undefined variable '%s'.", AS_STRING(vm.global_names.values[slot])->chars);
+}
+
+int jit_get_upvalue(int frame, uint8_t *ip, int slot, int unused) {
+  (void)unused;
+  jit_function(frame, ip);
+
+  push(*vm.frames[frame].closure->upvalues[slot]->location);
+  return 0;
+}
+
+int jit_set_upvalue(int frame, uint8_t *ip, int slot, int unused) {
+  (void)unused;
+  jit_function(frame, ip);
+
+  valp_obj_upvalue *upvalue = vm.frames[frame].closure->upvalues[slot];
+  *upvalue->location = peek(0);
+  WRITE_BARRIER(upvalue, peek(0));
+  return 0;
+}
+
+// OP_GET_PROPERTY replaces the receiver with the property,
+// OP_GET_PROPERTY_NO_POP pushes it on top.
+static int jit_property(int frame, uint8_t *ip, int constant, int cache, bool keep) {
+  valp_function *function = jit_function(frame, ip);
+
+  if (!IS_INSTANCE(peek(0))) JIT_ERROR("Only instances have properties.");
+
+  valp_instance *instance = AS_INSTANCE(peek(0));
+  valp_string *name = JIT_STRING(function, constant);
+  valp_cache_entry *entry = cache_lookup(function, &function->bytecode.caches[cache], instance, name);
+
+  valp_value value;
+  if (entry != NULL) {
+    if (entry->slot != -1) {
+      value = instance_slots(instance)[entry->slot];
+    } else {
+      value = OBJ_VAL(new_bound_method(peek(0), entry->method));
+    }
+  } else if (!instance_get_field(instance, name, &value)) {
+    return bind_method(instance->klass, name) ? 0 : 1;
+  }
+
+  if (keep) {
+    push(value);
+  } else {
+    vm.stack_top[-1] = value;
+  }
+  return 0;
+}
+
+int jit_get_property(int frame, uint8_t *ip, int constant, int cache) {
+  return jit_property(frame, ip, constant, cache, false);
+}
+
+int jit_get_property_no_pop(int frame, uint8_t *ip, int constant, int cache) {
+  return jit_property(frame, ip, constant, cache, true);
+}
+
+int jit_set_property(int frame, uint8_t *ip, int constant, int cache) {
+  valp_function *function = jit_function(frame, ip);
+
+  if (!IS_INSTANCE(peek(1))) JIT_ERROR("Only instances have fields.");
+
+  valp_instance *instance = AS_INSTANCE(peek(1));
+  valp_string *name = JIT_STRING(function, constant);
+  valp_inline_cache *inline_cache = &function->bytecode.caches[cache];
+  valp_shape *before = instance->shape;
+  valp_cache_entry *entry = before != NULL ? cache_find(inline_cache, before) : NULL;
+
+  if (entry == NULL) {
+    instance_set_field(instance, name, peek(0));
+    cache_store(function, inline_cache, instance, before, name);
+  } else if (entry->next_shape == NULL) {
+    instance_slots(instance)[entry->slot] = peek(0);
+    WRITE_BARRIER(instance, peek(0));
+  } else {
+    instance_append_field(instance, entry->next_shape, peek(0));
+  }
+
+  valp_value value = pop();
+  pop();
+  push(value);
+  return 0;
+}
+
+int jit_get_super(int frame, uint8_t *ip, int constant, int unused) {
+  (void)unused;
+  valp_function *function = jit_function(frame, ip);
+
+  valp_class *superclass = AS_CLASS(pop());
+  return bind_method(superclass, JIT_STRING(function, constant)) ? 0 : 1;
+}
+
+int jit_jump_compare(int frame, uint8_t *ip, int unused, int unused2) {
+  (void)unused;
+  (void)unused2;
+  jit_function(frame, ip);
+
+  bool equal = values_equal(peek(0), peek(1));
+  pop();
+  if (equal) {
+    pop();
+    return 0;
+  }
+
+  return 1;
+}
+
+int jit_call(int frame, uint8_t *ip, int arg_count, int unused) {
+  (void)unused;
+  jit_function(frame, ip);
+
+  int base = vm.frame_count;
+  if (!call_value(peek(arg_count), arg_count)) return 1;
+  return jit_finish_call(base);
+}
+
+int jit_invoke(int frame, uint8_t *ip, int constant_and_args, int cache) {
+  valp_function *function = jit_function(frame, ip);
+  valp_string *name = JIT_STRING(function, constant_and_args & 0xff);
+  int arg_count = constant_and_args >> 8;
+
+  int base = vm.frame_count;
+  if (!invoke(function, name, arg_count, &function->bytecode.caches[cache])) return 1;
+  return jit_finish_call(base);
+}
+
+int jit_super_invoke(int frame, uint8_t *ip, int constant, int arg_count) {
+  valp_function *function = jit_function(frame, ip);
+  valp_class *superclass = AS_CLASS(pop());
+
+  int base = vm.frame_count;
+  if (!invoke_from_class(superclass, JIT_STRING(function, constant), arg_count)) return 1;
+  return jit_finish_call(base);
+}
+
+int jit_closure(int frame, uint8_t *ip, int constant, int unused) {
+  (void)unused;
+  valp_function *function = jit_function(frame, ip);
+  valp_call_frame *current = &vm.frames[frame];
+
+  valp_obj_closure *closure = new_closure(AS_FUNCTION(function->bytecode.constants.values[constant]));
+  push(OBJ_VAL(closure));
+
+  // The (is_local, index) pairs are the bytes just before ip.
+  uint8_t *upvalues = ip - 2 * closure->upvalue_count;
+  for (int i = 0; i < closure->upvalue_count; i++) {
+    uint8_t is_local = upvalues[2 * i];
+    uint8_t index = upvalues[2 * i + 1];
+    if (is_local) {
+      closure->upvalues[i] = capture_upvalue(current->slots + index);
+    } else {
+      closure->upvalues[i] = current->closure->upvalues[index];
+    }
+    WRITE_BARRIER(closure, OBJ_VAL(closure->upvalues[i]));
+  }
+
+  return 0;
+}
+
+int jit_close_upvalue(int frame, uint8_t *ip, int unused, int unused2) {
+  (void)unused;
+  (void)unused2;
+  jit_function(frame, ip);
+
+  close_upvalues(vm.stack_top - 1);
+  pop();
+  return 0;
+}
+
+int jit_return(int frame, uint8_t *ip, int unused, int unused2) {
+  (void)unused;
+  (void)unused2;
+  jit_function(frame, ip);
+
+  valp_value result = pop();
+  valp_value *slots = vm.frames[frame].slots;
+
+  close_upvalues(slots);
+  vm.frame_count--;
+
+  vm.stack_top = slots;
+  push(result);
+  return 0;
+}
+
+int jit_new_array(int frame, uint8_t *ip, int size, int unused) {
+  (void)unused;
+  jit_function(frame, ip);
+
+  valp_array *arr = new_array();
+  push(OBJ_VAL(arr));
+
+  for (int i = size; i > 0; --i) {
+    write_valp_value_array(&arr->values, peek(i));
+    WRITE_BARRIER(arr, peek(i));
+  }
+
+  vm.stack_top -= size + 1;
+  push(OBJ_VAL(arr));
+  return 0;
+}
+
+int jit_slice(int frame, uint8_t *ip, int unused, int unused2) {
+  (void)unused;
+  (void)unused2;
+  jit_function(frame, ip);
+
+  if (!IS_NUMBER(peek(0))) JIT_ERROR("Argument must been a number.");
+
+  int idx = AS_NUMBER(pop());
+
+  if (!IS_ARRAY(peek(0))) JIT_ERROR("Caller must been an array.");
+
+  valp_array *array = AS_ARRAY(pop());
+
+  if (idx < 0 || idx > array->values.count - 1) JIT_ERROR("Index out of bound.");
+
+  push(array->values.values[idx]);
+  return 0;
+}
+
+int jit_heap_exhausted(int frame, uint8_t *ip, int unused, int unused2) {
+  (void)unused;
+  (void)unused2;
+  jit_function(frame, ip);
+  JIT_ERROR("Out of memory.");
+}
+
+#undef JIT_ERROR
+#undef JIT_STRING
+#endif
+
 valp_interpret_result interpret(const char *source) {
   valp_function *function = compile(source);
   if (function == NULL) return INTERPRET_COMPILE_ERROR;
@@ -658,5 +1513,5 @@ valp_interpret_result interpret(const char *source) {
   push(OBJ_VAL(closure));
   call_value(OBJ_VAL(closure), 0);
 
-  return run();
+  return run(0);
 }
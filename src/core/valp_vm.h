@@ -4,9 +4,24 @@
 #include "valp_object.h"
 #include "valp_value.h"
 #include "valp_hash.h"
+#include "valp_memory.h"
 
-#define FRAMES_MAX 64
+// The value stack and the call frames grow on demand up to these caps.
+// They are the defaults for vm.frame_max and vm.stack_max, which an
+// embedder can change after init_vm().
+#ifndef FRAMES_MAX
+#define FRAMES_MAX 16384
+#endif
+#ifndef STACK_MAX
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+#endif
+
+// Values natives and the VM itself push above the deepest a frame gets,
+// like the records gc_stats() builds.
+#define STACK_RESERVE 16
+
+#define FRAMES_INITIAL 8
+#define STACK_INITIAL (2 * UINT8_COUNT)
 
 typedef struct {
   valp_obj_closure *closure;
@@ -14,13 +29,28 @@ typedef struct {
   valp_value *slots;
 } valp_call_frame;
 
+typedef enum {
+  GC_IDLE,
+  GC_MARK,
+  GC_SWEEP
+} valp_gc_phase;
+
 typedef struct {
-  valp_call_frame frames[FRAMES_MAX];
+  valp_call_frame *frames;
   int frame_count;
+  int frame_capacity;
+  int frame_max;
 
-  valp_value stack[STACK_MAX];
+  valp_value *stack;
   valp_value* stack_top;
-  valp_hash globals;
+  int stack_capacity;
+  int stack_max;
+  // Globals live in a dense array indexed by the slot the compiler
+  // resolved the name to. A slot holds UNDEFINED_VAL until the global
+  // is defined.
+  valp_hash global_slots;
+  valp_value_array globals;
+  valp_value_array global_names;
   valp_hash constants;
   valp_hash strings;
   valp_string *init_string;
@@ -28,11 +58,44 @@ typedef struct {
 
   size_t bytes_allocated;
   size_t next_gc;
+  valp_gc_config gc;
+  valp_gc_stats gc_stats;
+  // Set once the heap hit gc.heap_limit, the interpreter raises the error
+  // at the next loop or call.
+  bool heap_exhausted;
+  // Set when the heap is worth compacting. The interpreter runs
+  // compact_heap() at its next safe point.
+  bool compact_pending;
 
   valp_hash array_methods;
   valp_hash string_methods;
+  valp_hash string_builder_methods;
+
+#ifdef JIT
+  // Compiled functions currently running on the C stack.
+  int jit_depth;
+#endif
 
+  // Objects start out in the nursery, vm.young, and the ones that survive
+  // a collection move to the old generation. Old objects on the slab pages
+  // are found through the page bitmaps, vm.objects holds the large ones.
+  // Old objects that may point at young ones are kept in the remembered
+  // set.
   valp_obj *objects;
+  valp_obj *young;
+  size_t young_bytes;
+  bool collecting_young;
+  int remembered_count;
+  int remembered_capacity;
+  valp_obj **remembered;
+
+  // State of the major collection in progress, if any.
+  valp_gc_phase gc_phase;
+  valp_array *scanning;
+  int scanned;
+  valp_obj **sweeping;
+  size_t gc_before;
+
   int gray_count;
   int gray_capacity;
   valp_obj **gray_stack;
@@ -52,6 +115,7 @@ valp_interpret_result interpret(const char *source);
 void push(valp_value value);
 valp_value pop();
 void runtime_error(const char *format, ...);
+int global_slot(valp_string *name);
 bool is_falsey(valp_value value);
 
 #endif
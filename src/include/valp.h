@@ -14,6 +14,10 @@
 // DEBUG_LOG_GC
 
 // NAN_BOXING
+// COMPUTED_GOTO
+// JIT
+// PARALLEL_MARK
+// CONCURRENT_SWEEP
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 